@@ -0,0 +1,24 @@
+#!/bin/bash
+#SBATCH --job-name=MPCC_MPI
+#SBATCH --constrain=skylake
+#SBATCH -N 8 # number of nodes
+#SBATCH --ntasks-per-node=1
+#SBATCH --exclusive
+#SBATCH --time 01:00:00 # time (D-HH:MM)
+#SBATCH --output MPCC_MPI.out # STDOUT
+
+# Strong scaling of the distributed driver (make MPI=1), one rank per node with OpenMP threads inside,
+# on the problem size of size_bxd_db.txt: m = 20000 genes, p = 7000 phenotypes, n = 150 individuals
+export OMP_NUM_THREADS=40
+export OMP_PLACES=cores
+export OMP_PROC_BIND=close
+export MKL_NUM_THREADS=40
+export MKL_ENABLE_INSTRUCTIONS=AVX512
+module swap intel-compilers intel-compilers/latest
+
+if [ ! -f matA.bin ]; then
+  srun -N 1 -n 1 ./MPCC --size=20000,150,7000 matA.bin matB.bin
+fi
+for nodes in 1 2 4 8; do
+  srun -N $nodes -n $nodes ./MPCC matA.bin matB.bin result.bin
+done
@@ -8,9 +8,23 @@
 //     sqrt[ (N sumA^2 - (sum A)^2)[ (N sumB^2 - (sum B)^2) ]
 
 //This code computes correlation coefficient between all row/column pairs of two matrices 
-// ./MPCC MatA_filename MatB_filename 
+// ./MPCC [--delim=<c>] [--header=<lines>] [--labels=<columns>] [--na=<NA,nan>] [--spearman[=approx]]
+//        [--precision=bf16|int8 [--rescore=<r>]] MatA_filename MatB_filename [MatP_filename]
+// ./MPCC MatA_filename MatB_filename MatP_filename budget_MB (out-of-core, see MPCCstream.cpp)
+// mpirun -np <ranks> ./MPCC [--block=<rows>] MatA_filename MatB_filename MatP_filename (make MPI=1, see MPCCmpi.cpp)
+// ./MPCC --size=<m>,<n>,<p> MatA_filename MatB_filename writes synthetic matrices of that size when the files do not exist
 
 #include "MPCC.h"
+#include "MPCCio.h"
+
+#include <vector>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef MPCC_MPI
+#include <mpi.h>
+#endif
 
 using namespace std;
 
@@ -22,10 +36,22 @@ using namespace std;
   #define NAIVE 0
 #endif
 
+#ifndef VECTOR //use the masked FMA vector version instead of the matrix version
+  #define VECTOR 0
+#endif
+
 #ifndef DOUBLE //default to float type
   #define DOUBLE 0
 #endif
 
+#ifndef PCC_TILE_M //rows of A per output tile of the matrix algorithm
+  #define PCC_TILE_M 256
+#endif
+
+#ifndef PCC_TILE_P //rows of B per output tile of the matrix algorithm
+  #define PCC_TILE_P 256
+#endif
+
 static DataType TimeSpecToSeconds(struct timespec* ts){
   return (DataType)ts->tv_sec + (DataType)ts->tv_nsec / 1000000000.0;
 }
@@ -34,95 +60,101 @@ static DataType TimeSpecToNanoSeconds(struct timespec* ts){
   return (DataType)ts->tv_sec*1000000000.0 + (DataType)ts->tv_nsec;
 }
 
-// This function convert a string to datatype (double or float);
-DataType convert_to_val(string text)
+#ifndef USING_R
+
+// Generate a synthetic rows x cols matrix with randomly assigned elements from [0,1] and then add
+// missing values in selected locations, the matrix is written to filename for future use
+static DataType* random_matrix(int rows, int cols, const char* filename)
 {
-    DataType val;
-    if(text=="nan" || text=="NaN" || text=="NAN"){ val = NANF;}
-    else{ val = atof(text.c_str());}
-    return val;
+  DataType randmax_recip=1/(DataType)RAND_MAX;
+  DataType* X = (DataType *)mkl_calloc( (size_t)rows*cols,sizeof( DataType ), 64 ); 
+  if (X == NULL ) {
+    printf( "\n ERROR: Can't allocate memory for a %d x %d matrix. Aborting... \n\n", rows, cols);
+    exit (0);
+  }
+  //random assignemnt of threads gives inconsistent values, so keep serial
+  size_t i;
+  #pragma omp parallel for private (i)
+  for (i=0; i<(size_t)rows*cols; i++) {
+    X[i]=(DataType)rand()*randmax_recip;
+  }
+  //add some missing value markers
+  //Note edge case: if missing data causes number of pairs compared to be <2, the result is divide by zero
+  X[0]                = MISSING_MARKER;
+  X[(size_t)rows*cols-1]      = MISSING_MARKER;
+  X[((size_t)(rows-1)*cols-1)]= MISSING_MARKER;
+
+  //write matrix to file
+  if(filename != NULL && !pcc_file_write(filename, rows, cols, X, NULL, NULL)){
+    printf("Can't write matrix to %s\n", filename);
+  }
+  return X;
 }
 
-#ifndef USING_R
-
 // This function initialized the matrices for m, n, p sized A and the B and result (C) matrices
 // Not part of the R interface since R initializes the memory
+//Input matrices are binary matrix files (see MPCCio.h), which are memory mapped and used in place,
+// or text files which are read in parallel (see MPCCtext.cpp). If an input file does not exist, a
+// synthetic matrix of the default dimensions is generated and written as binary matrix file.
 void initialize(int &m, int &n, int &p, int seed,
     DataType **A, 
     DataType **B,
     DataType **C,
     char* matA_filename,
     char* matB_filename,
-    bool &transposeB)
+    bool &transposeB,
+    pcc_matrix_file* fileA,
+    pcc_matrix_file* fileB,
+    const pcc_text_options* text)
 {
   // A is m x n (tall and skinny) row major order
-  // B is n x p (short and fat) row major order
+  // B is p x n (short and fat) row major order
   // C, P is m x p (big and square) row major order
+  srand(seed);
 
-  //if matA_filename exists, read in dimensions
-  // check for input file(s)
-  std::string text;
-  //DataType val;
-  fstream mat_A_file;
-
-  mat_A_file.open(matA_filename,ios::in);
-  if(mat_A_file.is_open()){
-     // if found then read
-     std::getline(mat_A_file, text);
-     m = convert_to_val(text);
-     std::getline(mat_A_file, text);
-     n = convert_to_val(text);
-     printf("m=%d n=%d\n",m,n);
-     mat_A_file.close();
-  }
-  //else use default value for m,n
-
-  *A = (DataType *)mkl_calloc( m*n,sizeof( DataType ), 64 ); 
-  if (*A == NULL ) {
-    printf( "\n ERROR: Can't allocate memory for matrix A. Aborting... \n\n");
-    mkl_free(*A);
-    exit (0);
+  if(pcc_file_open(matA_filename, fileA, true) || pcc_text_read(matA_filename, text, fileA)){
+    m = fileA->rows;
+    n = fileA->cols;
+    *A = fileA->data;
+  }else{
+    *A = random_matrix(m, n, matA_filename);
   }
+  printf("m=%d n=%d\n",m,n);
 
-  //if matB_filename exists, read in dimensions
-  // check for input file(s)
-  fstream mat_B_file;
   int _n=n;
-  mat_B_file.open(matB_filename,ios::in);
-  if(mat_B_file.is_open()){
-     // if found then read
-     std::getline(mat_B_file, text);
-     _n = convert_to_val(text);
-     std::getline(mat_B_file, text);
-     p = convert_to_val(text);
-     printf("_n=%d p=%d\n",_n,p);
-     mat_B_file.close();
-  }
-
-  //check to see if we need to transpose B
   transposeB=false;
-  if(_n !=n && n==p){//then transpose matrix B
-     p=_n;
-     _n=n; 
-     transposeB=true; 
-     printf("Transposing B for computational efficiency in GEMMs\n");
-     printf("transposed _n=%d p=%d\n",_n,p);
-   }
+  if(pcc_file_open(matB_filename, fileB, true) || pcc_text_read(matB_filename, text, fileB)){
+    p = fileB->rows;
+    _n = fileB->cols;
+    *B = fileB->data;
+    //check to see if we need to transpose B
+    if(_n !=n && n==p){//then transpose matrix B
+       DataType* Bt = (DataType *)mkl_malloc( (size_t)p*_n*sizeof( DataType ), 64 );
+       if (Bt == NULL ) {
+         printf( "\n ERROR: Can't allocate memory for matrix B. Aborting... \n\n");
+         exit (0);
+       }
+       int i,j;
+       #pragma omp parallel for private (i,j)
+       for (i=0; i<_n; i++) { for (j=0; j<p; j++) Bt[(size_t)i*p+j] = (*B)[(size_t)j*_n+i]; }
+       *B = Bt;
+       p=_n;
+       _n=n; 
+       transposeB=true; 
+       printf("Transposing B for computational efficiency in GEMMs\n");
+       printf("transposed _n=%d p=%d\n",_n,p);
+    }
+  }else{
+    *B = random_matrix(p, n, matB_filename);
+  }
+  printf("_n=%d p=%d\n",_n,p);
 
   //check that inner dimension matches
   assert(n==_n);
 
-  //else use default value for n,p
-  *B = (DataType *)mkl_calloc( n*p,sizeof( DataType ), 64 );
-  if (*B == NULL ) {
-    printf( "\n ERROR: Can't allocate memory for matrix B. Aborting... \n\n");
-    mkl_free(*B);
-    exit (0);
-  }
-
   printf("m=%d n=%d p=%d\n",m,n,p);
 
-  *C = (DataType *)mkl_calloc( m*p,sizeof( DataType ), 64 ); 
+  *C = (DataType *)mkl_calloc( (size_t)m*p,sizeof( DataType ), 64 ); 
   if (*C == NULL ) {
     printf( "\n ERROR: Can't allocate memory for matrix C. Aborting... \n\n");
     mkl_free(*C);
@@ -133,635 +165,1830 @@ void initialize(int &m, int &n, int &p, int seed,
   __assume_aligned(B, 64);
   __assume_aligned(C, 64);
   //__assume(m%16==0);
- 
-  //setup random numbers to create some synthetic matrices for correlation
-  // if input files do not exist
-  srand(seed);
-  DataType randmax_recip=1/(DataType)RAND_MAX;
-
-  //Input currently hard coded as binary files matrixA.dat and matrixB.dat
-  //Or text files input as command line parameters.
-  //with the form:
-  //int rows, cols 
-  //float elems[rows:cols]
-
-  //If input files do not exist, generate synthetic matrices of given dimensions A[m,p] B[p,n] 
-  //  with randomly assigned elements from [0,1] and then add missing values 
-  //  in selected locations (currently denoted by the value 2) 
-  //These matrices are of type single precision floating point values
-  
-  // check for input file(s)
-  mat_A_file.open(matA_filename,ios::in);
-  if(mat_A_file.is_open()){
-     // if found then read
-     std::getline(mat_A_file, text);
-     //m = convert_to_val(text);
-     std::getline(mat_A_file, text);
-     //n = convert_to_val(text);
-     for(int i=0;i<m*n;++i){ 
-        std::getline(mat_A_file, text);
-        (*A)[i] = convert_to_val(text);
-        //if(isnan((*A)[i])){printf("A[%d]==NAN\n",i);} 
-     }
-     mat_A_file.close();
-  }
-  else{ //else compute and then write matrix A
-    //random assignemnt of threads gives inconsistent values, so keep serial
-    int i;
-    #pragma omp parallel for private (i)
-    for (i=0; i<m*n; i++) {
-      (*A)[i]=(DataType)rand()*randmax_recip;
-    }
-    //add some missing value markers
-    //Note edge case: if missing data causes number of pairs compared to be <2, the result is divide by zero
-    (*A)[0]          = MISSING_MARKER;
-    (*A)[m*n-1]      = MISSING_MARKER;
-    (*A)[((m-1)*n-1)]= MISSING_MARKER;
-
-    //write matrix to file
-    mat_A_file.open(matA_filename,ios::out);
-    mat_A_file << m;
-    mat_A_file << n;
-    for(int i=0;i<m*n;++i) mat_A_file << (*A)[i] << '\n';
-    mat_A_file.close();
-  }
- 
-  //ceb Should write  out matrix and read in for future use.
-  // check for input file(s)
-  mat_B_file.open(matB_filename,ios::in);
-  if(mat_B_file.is_open()){
-     std::getline(mat_B_file, text);
-     //m = convert_to_val(text);
-     std::getline(mat_B_file, text);
-     //n = convert_to_val(text);
-     for(int i=0;i<n*p;++i){
-        std::getline(mat_B_file, text);
-        (*B)[i] = convert_to_val(text);
-        //if(isnan((*B)[i]) ){printf("B[%d]==NAN\n",i);}
-     }
-     mat_B_file.close();
-  }
-  else{ //else compute and then write matrix B
-    int i;
-    //random assignemnt of threads gives inconsistent values, so keep serial
-    #pragma omp parallel for private (i)
-    for (i=0; i<n*p; i++) {
-      (*B)[i]=(DataType)rand()*randmax_recip;
-    }
-    //add some missing value markers
-    //ceb if missing data causes number of pairs compared to be <2, the result is divide by zero
-    (*B)[0]          = MISSING_MARKER;
-    (*B)[n*p-1]      = MISSING_MARKER;
-    (*B)[((n-1)*p-1)]= MISSING_MARKER;
-   
-    //write matrix to file
-    mat_B_file.open(matB_filename,ios::out);
-    mat_B_file << n;
-    mat_B_file << p;
-    for(int i=0; i<n*p; ++i) mat_B_file << (*B)[i];
-    mat_B_file.close();
-  }
 #if 0
-  for (int i=0; i<m; i++) { for(int j=0;j<n;++j){printf("A[%d,%d]=%e\n",i,j,(*A)[i*n+j]);}}
-  for (int i=0; i<n; i++) { for(int j=0;j<p;++j){printf("B[%d,%d]=%e\n",i,j,(*B)[i*p+j]);}}
+  for (int i=0; i<m; i++) { for(int j=0;j<n;++j){printf("A[%d,%d]=%e\n",i,j,(*A)[(size_t)i*n+j]);}}
+  for (int i=0; i<p; i++) { for(int j=0;j<n;++j){printf("B[%d,%d]=%e\n",i,j,(*B)[(size_t)i*n+j]);}}
 #endif
   return;
 };
 
 #endif
 
-#ifndef NOMKL
+#ifndef NOBLAS
 
-//This function is the implementation of a matrix x matrix algorithm which computes a matrix of PCC values
-//but increases the arithmetic intensity of the naive pairwise vector x vector correlation
-//A is matrix of X vectors and B is transposed matrix of Y vectors:
-//P = [ sum(AB) - (sumA)(sumB)/N] /
-//    sqrt[ ( sumA^2 -(1/N) (sum A/)^2)[ ( sumB^2 - (1/N)(sum B)^2) ]
-int pcc_matrix(int m, int n, int p,
-               DataType* A, DataType* B, DataType* P)
+//Per-thread scratch for one output tile of the matrix algorithm.
+//Every buffer holds at most one PCC_TILE_M x PCC_TILE_P (or PCC_TILE_M x PCC_TILE_M for the
+// symmetric algorithm) tile, so peak scratch memory is O(threads * tile) instead of O(m*p)
+//UnitA and UnitB hold the bit masks of the tile rows expanded to 0.0/1.0 for the masked GEMMs.
+struct pcc_tile_scratch {
+  DataType *N, *SA, *SB, *SAA, *SBB, *SAB;
+  DataType *UnitA, *UnitB;
+  bool owned;       //buffers were allocated, not carved from a workspace
+};
+
+//Buffers can be carved from a caller owned workspace instead of being allocated one by one,
+// pcc_carve hands out the next 64 byte aligned block of bytes and advances the workspace pointer
+static inline size_t pcc_round64(size_t bytes){
+  return (bytes + 63) & ~(size_t)63;
+}
+
+static inline void* pcc_carve(char** mem, size_t bytes){
+  void* ptr = *mem;
+  *mem += pcc_round64(bytes);
+  return ptr;
+}
+
+static inline void* pcc_alloc(char** mem, size_t bytes){
+  return (mem != NULL) ? pcc_carve(mem, bytes) : mkl_malloc( bytes > 0 ? bytes : 1, 64 );
+}
+
+static void pcc_tile_scratch_free(pcc_tile_scratch* s){
+  if (!s->owned) return;
+  mkl_free(s->N);    mkl_free(s->SA);   mkl_free(s->SB);
+  mkl_free(s->SAA);  mkl_free(s->SBB);  mkl_free(s->SAB);
+  mkl_free(s->UnitA); mkl_free(s->UnitB);
+}
+
+//Workspace bytes of pcc_tile_scratch_alloc for rows of length n
+static size_t pcc_tile_scratch_bytes(int n){
+  size_t tileP = (PCC_TILE_P > PCC_TILE_M) ? PCC_TILE_P : PCC_TILE_M;
+  return 6*pcc_round64(PCC_TILE_M*tileP*sizeof(DataType)) +
+         pcc_round64(PCC_TILE_M*n*sizeof(DataType)) + pcc_round64(tileP*n*sizeof(DataType));
+}
+
+//returns false if any of the tile buffers could not be allocated, with mem the buffers are carved
+// from the workspace at *mem (of at least pcc_tile_scratch_bytes(n) bytes)
+static bool pcc_tile_scratch_alloc(pcc_tile_scratch* s, int n, char** mem = NULL){
+  int tileP = (PCC_TILE_P > PCC_TILE_M) ? PCC_TILE_P : PCC_TILE_M;
+  int tsize = PCC_TILE_M*tileP;
+  DataType** bufs[] = { &s->N, &s->SA, &s->SB, &s->SAA, &s->SBB, &s->SAB };
+  bool ok = true;
+  s->owned = (mem == NULL);
+  for (unsigned int b=0; b<sizeof(bufs)/sizeof(bufs[0]); b++) {
+    *bufs[b] = (DataType*)pcc_alloc(mem, tsize*sizeof(DataType));
+    if (*bufs[b] == NULL) ok = false;
+  }
+  s->UnitA = (DataType*)pcc_alloc(mem, (size_t)PCC_TILE_M*n*sizeof(DataType));
+  s->UnitB = (DataType*)pcc_alloc(mem, (size_t)tileP*n*sizeof(DataType));
+  if ( (s->UnitA == NULL) | (s->UnitB == NULL) ) ok = false;
+  return ok;
+}
+
+//Missingness masks are stored with one bit per observation (1 = observed), packed into
+// 64 bit words, PCC_MASK_WORDS(n) words per row.
+#define PCC_MASK_WORDS(n) (((n) + 63) / 64)
+
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+//Sum of the 8 lanes through an aligned store, _mm512_reduce_add_epi64 is reported as maybe-uninitialized by GCC
+static inline int64_t pcc_hsum_epi64(__m512i v)
 {
-  int i,j,k;
-  int stride = ((n-1)/64 +1);
-  DataType alpha=1.0;
-  DataType beta=0.0;
-  int count =1;
-  bool transposeB = true; //assume this is always true. 
-  //info("before calloc\n",1);
-  //allocate and initialize and align memory needed to compute PCC
-  DataType *N = (DataType *) mkl_calloc( m*p,sizeof( DataType ), 64 );
-  __assume_aligned(N, 64);
-  DataType *M = (DataType *) mkl_calloc( m*p, sizeof( DataType ), 64 );
-  __assume_aligned(M, 64);
-  DataType* SA =    ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 ); 
-  __assume_aligned(SA, 64);
-  DataType* AA =    ( DataType*)mkl_calloc( m*n, sizeof(DataType), 64 ); 
-  __assume_aligned(AA, 64);
-  DataType* SAA =   ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 );
-  __assume_aligned(SAA, 64);
-  DataType* SB =    ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 ); 
-  __assume_aligned(SB, 64);
-  DataType* BB =    ( DataType*)mkl_calloc( n*p, sizeof(DataType), 64 ); 
-  __assume_aligned(BB, 64);
-  DataType* SBB =   ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 ); 
-  __assume_aligned(SBB, 64);
-  DataType* SAB =   ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 );
-  __assume_aligned(SAB, 64);
-  DataType* UnitA = ( DataType*)mkl_calloc( m*n, sizeof(DataType), 64 );
-  __assume_aligned(UnitA, 64);
-  DataType* UnitB = ( DataType*)mkl_calloc( n*p, sizeof(DataType), 64 );
-  __assume_aligned(UnitB, 64);  
-  DataType *amask=(DataType*)mkl_calloc( m*n, sizeof(DataType), 64);
-  __assume_aligned(amask, 64);
-  DataType *bmask=(DataType*)mkl_calloc( n*p, sizeof(DataType), 64);
-  __assume_aligned(bmask, 64);
-
-  //info("after calloc\n",1);
+  alignas(64) int64_t t[8];
+  _mm512_store_si512((void*)t, v);
+  int64_t sum = 0;
+  for (int l=0; l<8; l++) sum += t[l];
+  return sum;
+}
+#endif
 
-  //if any of the above allocations failed, then we have run out of RAM on the node and we need to abort
-  if ( (N == NULL) | (M == NULL) | (SA == NULL) | (AA == NULL) | (SAA == NULL) | (SB == NULL) | (BB == NULL) | 
-      (SBB == NULL) | (SAB == NULL) | (UnitA == NULL) | (UnitB == NULL) | (amask == NULL) | (bmask == NULL)) {
-    printf( "\n ERROR: Can't allocate memory for intermediate matrices. Aborting... \n\n");
-    mkl_free(N);
-    mkl_free(M);
-    mkl_free(SA);
-    mkl_free(AA);
-    mkl_free(SAA);
-    mkl_free(SB);
-    mkl_free(BB);
-    mkl_free(SBB);
-    mkl_free(SAB);
-    mkl_free(UnitA);
-    mkl_free(UnitB);
-    mkl_free(amask);
-    mkl_free(bmask);
-    #ifndef USING_R
-    exit (0);
-    #else
-    return(0);
-    #endif
-  } 
+//Number of observations present in both masked rows a and b: popcount(a & b)
+static inline int pcc_popcount_and(const uint64_t* a, const uint64_t* b, int words)
+{
+  int w = 0;
+  int count = 0;
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+  __m512i acc = _mm512_setzero_si512();
+  for (; w+8<=words; w+=8) {
+    __m512i ab = _mm512_and_si512(_mm512_loadu_si512((const void*)&a[w]), _mm512_loadu_si512((const void*)&b[w]));
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(ab));
+  }
+  count = (int)pcc_hsum_epi64(acc);
+#elif defined(__AVX2__)
+  //nibble lookup popcount (Mula), accumulated per byte and summed with SAD
+  const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                          0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256();
+  for (; w+4<=words; w+=4) {
+    __m256i ab = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)&a[w]), _mm256_loadu_si256((const __m256i*)&b[w]));
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(ab, low)),
+                                  _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(ab, 4), low)));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+  }
+  count = (int)(_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+                _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3));
+#endif
+  for (; w<words; w++) count += __builtin_popcountll(a[w] & b[w]);
+  return count;
+}
 
-  //info("before deal missing data\n",1);
+//N[i,j] = popcount(maskA_i & maskB_j) for an mb x pb tile (row stride pb), the pairwise
+// complete counts of incomplete x incomplete rows. Only j >= i is computed when upper is set.
+static void pcc_popcount_tile(int mb, int pb, int words, const uint64_t* bitsA, const uint64_t* bitsB,
+                              DataType* N, bool upper)
+{
+  for (int i=0; i<mb; i++) {
+    const uint64_t* a = &bitsA[(size_t)i*words];
+    for (int j=(upper ? i : 0); j<pb; j++) {
+      N[i*pb + j] = (DataType)pcc_popcount_and(a, &bitsB[(size_t)j*words], words);
+    }
+  }
+}
 
-  //deal with missing data
-  for (int ii=0; ii<count; ii++) {
+//Expand the bit masks of rows masked rows into 0.0/1.0 values (rows x n, row major) for the GEMMs
+static void pcc_expand_mask(int rows, int n, const uint64_t* bits, DataType* U)
+{
+  int words = PCC_MASK_WORDS(n);
+  for (int i=0; i<rows; i++) {
+    const uint64_t* b = &bits[(size_t)i*words];
+    DataType* u = &U[(size_t)i*n];
+    #pragma omp simd
+    for (int k=0; k<n; k++) u[k] = (DataType)((b[k >> 6] >> (k & 63)) & 1);
+  }
+}
+
+//Rows of A (or B) prepared for the matrix algorithm and partitioned by missingness:
+// packed rows 0..nfull-1 are the complete rows, packed rows nfull..rows-1 the rows with missing
+// values, both groups in their original order. Only the incomplete rows carry a (bit packed) mask,
+// the complete rows are also stored standardized so that complete x complete blocks need a single GEMM.
+struct pcc_rowset {
+  int rows;         //number of rows
+  int nfull;        //number of complete rows, stored first
+  bool identity;    //packed order equals the original order
+  int* order;       //original row index of every packed row
+  DataType* X;      //packed rows, missing values replaced by 0.0
+  DataType* XX;     //element wise squares of X
+  uint64_t* bits;   //bit masks of the incomplete rows, row r-nfull belongs to packed row r
+  DataType* Z;      //standardized complete rows
+  DataType* cnt;    //per packed row: number of observed values
+  DataType* sum;    //per packed row: sum of the observed values
+  DataType* sumsq;  //per packed row: sum of squares of the observed values
+  bool owned;       //buffers were allocated, not carved from a workspace
+  int qtype;        //PCC_PRECISION_* of the SAB products
+  int qld;          //padded row length of Q
+  void* Q;          //packed rows quantized to int8_t or bf16 (uint16_t), NULL in full precision
+  float* qscale;    //per packed row: scale of the int8 values
+  int32_t* qsum;    //per packed row: sum of the int8 values
+};
 
-    //if element in A is missing, set amask and A to 0
-    #pragma omp parallel for private (i,k)
-    for (i=0; i<m; i++) {
+static void pcc_rowset_free(pcc_rowset* rs){
+  mkl_free(rs->Q); mkl_free(rs->qscale); mkl_free(rs->qsum); //always allocated
+  if (!rs->owned) return;
+  mkl_free(rs->order);
+  mkl_free(rs->X);     mkl_free(rs->XX);  mkl_free(rs->bits); mkl_free(rs->Z);
+  mkl_free(rs->cnt);   mkl_free(rs->sum); mkl_free(rs->sumsq);
+}
+
+//Standardize the rows of the complete (no missing data) rows x n matrix X into Z,
+// z = (x - mean(x)) / sqrt(sum((x - mean(x))^2)), so that Z*Z' holds the PCC values.
+//Rows without variance are set to 0, matching the 0 returned by the masked algorithm.
+//Mean and sum of squares are accumulated in double, also when DataType is float.
+static void pcc_standardize_rows(int rows, int n, const DataType* X, DataType* Z)
+{
+  int i,k;
+  #pragma omp parallel for private (i,k)
+  for (i=0; i<rows; i++) {
+    const DataType* x = &X[(size_t)i*n];
+    DataType* z = &Z[(size_t)i*n];
+    double sum = 0.0;
+    #pragma omp simd reduction(+:sum)
+    for (k=0; k<n; k++) sum += x[k];
+    DataType mean = (DataType)(sum / n);
+    double ss = 0.0;
+    #pragma omp simd reduction(+:ss)
+    for (k=0; k<n; k++) ss += (double)(x[k] - mean) * (x[k] - mean);
+    DataType scale = (ss > 0.0) ? (DataType)(1.0 / sqrt(ss)) : (DataType)0.0;
+    #pragma omp simd
+    for (k=0; k<n; k++) z[k] = (x[k] - mean) * scale;
+  }
+}
+
+//Workspace bytes of pcc_rowset_init for a rows x n matrix
+static size_t pcc_rowset_bytes(int rows, int n){
+  size_t r = rows, rn = (size_t)rows*n;
+  return 2*pcc_round64(r*sizeof(int)) + 3*pcc_round64(rn*sizeof(DataType)) +
+         pcc_round64(r*PCC_MASK_WORDS(n)*sizeof(uint64_t)) + 3*pcc_round64(r*sizeof(DataType));
+}
+
+//Plan and pack the rows x n matrix X (row major) into rs. Missing values are detected per row,
+// the rows are split into the complete and incomplete set and packed in that order.
+//With mem the buffers are carved from the workspace at *mem (of at least pcc_rowset_bytes(rows, n) bytes).
+//Row i of X starts at X[i*ldx] (ldx = 0: n) and its elements are incx apart, so strided sub matrices and
+// transposed (column major) matrices are packed in place, without copying them out of X first.
+//With cols only the observations cols[0..n-1] of the rows of X are packed, so a subset of the
+// observations is used in place as well.
+//Returns false if memory could not be allocated, rs can be freed with pcc_rowset_free either way.
+static bool pcc_rowset_init(pcc_rowset* rs, int rows, int n, const DataType* X, char** mem = NULL,
+                            const int* cols = NULL, int ldx = 0, int incx = 1)
+{
+  int i,k;
+  if (ldx == 0) ldx = n;
+  rs->rows = rows;
+  rs->owned = (mem == NULL);
+  rs->X = rs->XX = rs->Z = rs->cnt = rs->sum = rs->sumsq = NULL;
+  rs->bits = NULL;
+  rs->qtype = PCC_PRECISION_FULL;
+  rs->qld = 0;
+  rs->Q = NULL; rs->qscale = NULL; rs->qsum = NULL;
+  rs->order = (int*)pcc_alloc(mem, (size_t)rows*sizeof(int));
+  int* rowmissing = (int*)pcc_alloc(mem, (size_t)rows*sizeof(int));
+  if ( (rs->order == NULL) | (rowmissing == NULL) ) {
+    if (rs->owned) mkl_free(rowmissing);
+    return false;
+  }
+
+  //count the missing values of every row
+  #pragma omp parallel for private (i,k)
+  for (i=0; i<rows; i++) {
+    const DataType* x = &X[(size_t)i*ldx];
+    int nmissing = 0;
+    for (k=0; k<n; k++) {
+      if (CHECKNA(x[(size_t)(cols != NULL ? cols[k] : k)*incx])) nmissing++;
+    }
+    rowmissing[i] = nmissing;
+  }
+
+  //complete rows first, then the rows with missing values
+  int r = 0;
+  for (i=0; i<rows; i++) if (rowmissing[i] == 0) rs->order[r++] = i;
+  rs->nfull = r;
+  for (i=0; i<rows; i++) if (rowmissing[i] != 0) rs->order[r++] = i;
+  if (rs->owned) mkl_free(rowmissing);
+  rs->identity = true;
+  for (r=0; r<rows; r++) if (rs->order[r] != r) rs->identity = false;
+
+  int nmiss = rows - rs->nfull;
+  int words = PCC_MASK_WORDS(n);
+  rs->X =     (DataType*)pcc_alloc(mem, (size_t)rows*n*sizeof(DataType));
+  rs->XX =    (DataType*)pcc_alloc(mem, (size_t)rows*n*sizeof(DataType));
+  rs->bits =  (uint64_t*)pcc_alloc(mem, (size_t)nmiss*words*sizeof(uint64_t));
+  rs->Z =     (DataType*)pcc_alloc(mem, (size_t)rs->nfull*n*sizeof(DataType));
+  rs->cnt =   (DataType*)pcc_alloc(mem, (size_t)rows*sizeof(DataType));
+  rs->sum =   (DataType*)pcc_alloc(mem, (size_t)rows*sizeof(DataType));
+  rs->sumsq = (DataType*)pcc_alloc(mem, (size_t)rows*sizeof(DataType));
+  if ( (rs->X == NULL) | (rs->XX == NULL) | (rs->bits == NULL) | (rs->Z == NULL) |
+       (rs->cnt == NULL) | (rs->sum == NULL) | (rs->sumsq == NULL) ) {
+    return false;
+  }
+  memset(rs->bits, 0, (size_t)nmiss*words*sizeof(uint64_t));
+
+  //pack the rows, replace missing values by 0.0 and compute the masks and row statistics
+  //Every row is shifted by the mean of its observed values. PCC values do not change under a shift, but
+  // the raw moment terms N*SAB - SA*SB of shifted rows are small, so they do not cancel catastrophically
+  // when the mean of a row is large compared to its spread (e.g. log expression values around 10 with
+  // sd 0.2), which makes float accurate. Row statistics are accumulated in double.
+  #pragma omp parallel for private (i,k)
+  for (i=0; i<rows; i++) {
+    const DataType* x = &X[(size_t)rs->order[i]*ldx];
+    DataType* x0 = &rs->X[(size_t)i*n];
+    DataType* xx = &rs->XX[(size_t)i*n];
+    double c = 0.0, s = 0.0, ss = 0.0;
+    if (cols != NULL || incx != 1) {
+      //gather the selected or strided observations, then pack them in place
+      for (k=0; k<n; k++) x0[k] = x[(size_t)(cols != NULL ? cols[k] : k)*incx];
+      x = x0;
+    }
+    double shift = 0.0;
+    for (k=0; k<n; k++) {
+      if (!CHECKNA(x[k])) { shift += x[k]; c += 1.0; }
+    }
+    DataType mean = (c > 0.0) ? (DataType)(shift / c) : (DataType)0.0;
+    if (i < rs->nfull) {
+      for (k=0; k<n; k++) {
+        x0[k] = x[k] - mean;
+        xx[k] = x0[k] * x0[k];
+        s += x0[k];
+        ss += xx[k];
+      }
+    } else {
+      uint64_t* u = &rs->bits[(size_t)(i - rs->nfull)*words];
       for (k=0; k<n; k++) {
-        amask[ i*n + k ] = 1.0;
-        if (CHECKNA(A[i*n+k])) { 
-          amask[i*n + k] = 0.0;
-          A[i*n + k] = 0.0; // set A to 0.0 for subsequent calculations of PCC terms
+        if (CHECKNA(x[k])) { 
+          x0[k] = 0.0; // set X to 0.0 for subsequent calculations of PCC terms
         }else{
-          UnitA[i*n + k] = 1.0;
+          x0[k] = x[k] - mean;
+          u[k >> 6] |= (uint64_t)1 << (k & 63);
         }
+        xx[k] = x0[k] * x0[k];
+        s += x0[k];
+        ss += xx[k];
       }
     }
+    rs->cnt[i] = c;
+    rs->sum[i] = s;
+    rs->sumsq[i] = ss;
+  }
 
-    //if element in B is missing, set bmask and B to 0
-    #pragma omp parallel for private (j,k)
-    for (j=0; j<p; j++) {
-      for (k=0; k<n; k++) {
-        bmask[ j*n + k ] = 1.0;
-        if (CHECKNA(B[j*n+k])) { 
-          bmask[j*n + k] = 0.0;
-          B[j*n + k] = 0.0; // set B to 0.0 for subsequent calculations of PCC terms
-        }else{
-          UnitB[j*n + k] = 1.0;
+  pcc_standardize_rows(rs->nfull, n, rs->X, rs->Z);
+  return true;
+}
+
+//Split the packed rows of rs into tiles of at most tile rows which never straddle the boundary
+// between the complete and the incomplete rows. starts and sizes need room for rows/tile + 2 tiles.
+static int pcc_rowset_tiles(const pcc_rowset* rs, int tile, int* starts, int* sizes)
+{
+  int ntiles = 0;
+  int bounds[3] = { 0, rs->nfull, rs->rows };
+  for (int g=0; g<2; g++) {
+    for (int r=bounds[g]; r<bounds[g+1]; r+=tile) {
+      starts[ntiles] = r;
+      sizes[ntiles] = (bounds[g+1] - r < tile) ? (bounds[g+1] - r) : tile;
+      ntiles++;
+    }
+  }
+  return ntiles;
+}
+
+//Reduced precision SAB products (PCC_PRECISION_BF16 / PCC_PRECISION_INT8), for screening runs.
+//The packed rows are quantized once per row: int8 with a per row scale, q = round(x / s) with
+// s = max|x| / 127, or bf16 (the upper half of the float, rounded to nearest even). The SAB products of
+// a tile are accumulated in int32 (int8) or float (bf16), with the AVX512-VNNI / AVX512-BF16 dot product
+// instructions when the compiler targets them and with plain loops otherwise. The rows are centered
+// (see pcc_rowset_init), so the quantization error stays small compared to the products. N, SA, SB, SAA
+// and SBB stay in full precision.
+//Quantized rows are padded with zeros to a multiple of 64 bytes, the dot products run over whole vectors.
+#define PCC_QUANT_BLOCK 16384 //int8 products per int32 partial sum, far below the int32 overflow
+
+static inline uint16_t pcc_to_bf16(float f){
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  u += 0x7fff + ((u >> 16) & 1);
+  return (uint16_t)(u >> 16);
+}
+
+static inline float pcc_from_bf16(uint16_t h){
+  uint32_t u = (uint32_t)h << 16;
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+//Horizontal sums of the 16 lanes of an AVX512 register, through an aligned store. The shuffles and
+// casts of _mm512_reduce_add_* have undefined pass-through operands, which GCC reports as
+// maybe-uninitialized. The sums are taken once per row pair (per block), after the dot product loop.
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+static inline int32_t pcc_hsum_epi32(__m512i v)
+{
+  alignas(64) int32_t t[16];
+  _mm512_store_si512((void*)t, v);
+  int32_t sum = 0;
+  for (int l=0; l<16; l++) sum += t[l];
+  return sum;
+}
+#endif
+
+#if defined(__AVX512BF16__)
+static inline float pcc_hsum_ps(__m512 v)
+{
+  alignas(64) float t[16];
+  _mm512_store_ps(t, v);
+  float sum = 0.0f;
+  for (int l=0; l<16; l++) sum += t[l];
+  return sum;
+}
+#endif
+
+//dot product of two int8 rows of len (a multiple of 64) values, bsum is the sum of b
+static inline int64_t pcc_dot_int8(const int8_t* a, const int8_t* b, int32_t bsum, int len)
+{
+  int64_t dot = 0;
+  for (int k0=0; k0<len; k0+=PCC_QUANT_BLOCK) {
+    int kend = (len - k0 < PCC_QUANT_BLOCK) ? len : k0 + PCC_QUANT_BLOCK;
+    int32_t acc = 0;
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    //vpdpbusd multiplies unsigned with signed bytes: (a + 128).b is corrected by 128*sum(b) below
+    const __m512i bias = _mm512_set1_epi8((char)0x80);
+    __m512i vacc = _mm512_setzero_si512();
+    for (int k=k0; k<kend; k+=64) {
+      __m512i va = _mm512_xor_si512(_mm512_load_si512((const void*)&a[k]), bias);
+      vacc = _mm512_dpbusd_epi32(vacc, va, _mm512_load_si512((const void*)&b[k]));
+    }
+    acc = pcc_hsum_epi32(vacc);
+#else
+    #pragma omp simd reduction(+:acc)
+    for (int k=k0; k<kend; k++) acc += (int32_t)a[k] * (int32_t)b[k];
+#endif
+    dot += acc;
+  }
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+  dot -= (int64_t)128 * bsum;
+#else
+  (void)bsum;
+#endif
+  return dot;
+}
+
+//dot product of two bf16 rows of len (a multiple of 32) values
+static inline float pcc_dot_bf16(const uint16_t* a, const uint16_t* b, int len)
+{
+#if defined(__AVX512BF16__)
+  __m512 acc = _mm512_setzero_ps();
+  for (int k=0; k<len; k+=32) {
+    acc = _mm512_dpbf16_ps(acc, (__m512bh)_mm512_load_si512((const void*)&a[k]),
+                                (__m512bh)_mm512_load_si512((const void*)&b[k]));
+  }
+  return pcc_hsum_ps(acc);
+#else
+  float acc = 0.0f;
+  #pragma omp simd reduction(+:acc)
+  for (int k=0; k<len; k++) acc += pcc_from_bf16(a[k]) * pcc_from_bf16(b[k]);
+  return acc;
+#endif
+}
+
+//Quantize the packed rows of rs to qtype, returns false if memory could not be allocated
+static bool pcc_rowset_quantize(pcc_rowset* rs, int n, int qtype)
+{
+  size_t elem = (qtype == PCC_PRECISION_INT8) ? sizeof(int8_t) : sizeof(uint16_t);
+  int rows = rs->rows;
+  rs->qtype = qtype;
+  rs->qld = (int)(pcc_round64(n*elem) / elem);
+  rs->Q = mkl_calloc( ((size_t)rows*rs->qld > 0 ? (size_t)rows*rs->qld : 1), elem, 64 );
+  rs->qscale = (float*)mkl_malloc( (rows > 0 ? rows : 1)*sizeof(float), 64 );
+  rs->qsum = (int32_t*)mkl_malloc( (rows > 0 ? rows : 1)*sizeof(int32_t), 64 );
+  if ( (rs->Q == NULL) | (rs->qscale == NULL) | (rs->qsum == NULL) ) return false;
+
+  #pragma omp parallel for
+  for (int i=0; i<rows; i++) {
+    const DataType* x = &rs->X[(size_t)i*n];
+    rs->qscale[i] = 1.0f;
+    rs->qsum[i] = 0;
+    if (qtype == PCC_PRECISION_INT8) {
+      int8_t* q = &((int8_t*)rs->Q)[(size_t)i*rs->qld];
+      DataType mx = 0.0;
+      for (int k=0; k<n; k++) mx = max(mx, (DataType)fabs(x[k]));
+      if (mx == 0.0) continue;
+      float scale = (float)(mx / 127.0);
+      int32_t sum = 0;
+      for (int k=0; k<n; k++) {
+        q[k] = (int8_t)lrintf((float)(x[k] / scale));
+        sum += q[k];
+      }
+      rs->qscale[i] = scale;
+      rs->qsum[i] = sum;
+    } else {
+      uint16_t* q = &((uint16_t*)rs->Q)[(size_t)i*rs->qld];
+      for (int k=0; k<n; k++) q[k] = pcc_to_bf16((float)x[k]);
+    }
+  }
+  return true;
+}
+
+//4 x 4 blocks of dot products of quantized rows, every loaded vector is used four times
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+static inline void pcc_dot4x4_int8(const int8_t* a, const int8_t* b, const int32_t* bsum, int ld, DataType* C, int ldc,
+                                   const float* sa, const float* sb)
+{
+  const __m512i bias = _mm512_set1_epi8((char)0x80);
+  int64_t dot[4][4] = {{0}};
+  for (int k0=0; k0<ld; k0+=PCC_QUANT_BLOCK) {
+    int kend = (ld - k0 < PCC_QUANT_BLOCK) ? ld : k0 + PCC_QUANT_BLOCK;
+    __m512i acc[4][4];
+    for (int i=0; i<4; i++) for (int j=0; j<4; j++) acc[i][j] = _mm512_setzero_si512();
+    for (int k=k0; k<kend; k+=64) {
+      __m512i va[4];
+      for (int i=0; i<4; i++) va[i] = _mm512_xor_si512(_mm512_load_si512((const void*)&a[(size_t)i*ld + k]), bias);
+      for (int j=0; j<4; j++) {
+        __m512i vb = _mm512_load_si512((const void*)&b[(size_t)j*ld + k]);
+        for (int i=0; i<4; i++) acc[i][j] = _mm512_dpbusd_epi32(acc[i][j], va[i], vb);
+      }
+    }
+    for (int i=0; i<4; i++) for (int j=0; j<4; j++) dot[i][j] += pcc_hsum_epi32(acc[i][j]);
+  }
+  for (int i=0; i<4; i++) {
+    for (int j=0; j<4; j++) {
+      C[(size_t)i*ldc + j] = (DataType)((double)sa[i] * sb[j] * (dot[i][j] - (int64_t)128 * bsum[j]));
+    }
+  }
+}
+#endif
+
+#if defined(__AVX512BF16__)
+static inline void pcc_dot4x4_bf16(const uint16_t* a, const uint16_t* b, int ld, DataType* C, int ldc)
+{
+  __m512 acc[4][4];
+  for (int i=0; i<4; i++) for (int j=0; j<4; j++) acc[i][j] = _mm512_setzero_ps();
+  for (int k=0; k<ld; k+=32) {
+    __m512bh va[4];
+    for (int i=0; i<4; i++) va[i] = (__m512bh)_mm512_load_si512((const void*)&a[(size_t)i*ld + k]);
+    for (int j=0; j<4; j++) {
+      __m512bh vb = (__m512bh)_mm512_load_si512((const void*)&b[(size_t)j*ld + k]);
+      for (int i=0; i<4; i++) acc[i][j] = _mm512_dpbf16_ps(acc[i][j], va[i], vb);
+    }
+  }
+  for (int i=0; i<4; i++) for (int j=0; j<4; j++) C[(size_t)i*ldc + j] = (DataType)pcc_hsum_ps(acc[i][j]);
+}
+#endif
+
+//SAB of an mb x pb tile (row stride ldc) from the quantized packed rows of a starting at i0 and b
+// starting at j0, only j >= i is needed when upper is set. The rows of the b tile stay in cache,
+// with the dot product instructions full 4 x 4 blocks use the blocked kernels.
+static void pcc_quant_tile(const pcc_rowset* a, int i0, int mb, const pcc_rowset* b, int j0, int pb,
+                           DataType* C, int ldc, bool upper)
+{
+  int ld = a->qld;
+  bool int8 = (a->qtype == PCC_PRECISION_INT8);
+  for (int ib=0; ib<mb; ib+=4) {
+    for (int jb=(upper ? ib : 0); jb<pb; jb+=4) {
+      bool block = (ib + 4 <= mb) && (jb + 4 <= pb);
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+      if (block && int8) {
+        pcc_dot4x4_int8(&((const int8_t*)a->Q)[(size_t)(i0 + ib)*ld], &((const int8_t*)b->Q)[(size_t)(j0 + jb)*ld],
+                        &b->qsum[j0 + jb], ld, &C[(size_t)ib*ldc + jb], ldc, &a->qscale[i0 + ib], &b->qscale[j0 + jb]);
+        continue;
+      }
+#endif
+#if defined(__AVX512BF16__)
+      if (block && !int8) {
+        pcc_dot4x4_bf16(&((const uint16_t*)a->Q)[(size_t)(i0 + ib)*ld], &((const uint16_t*)b->Q)[(size_t)(j0 + jb)*ld],
+                        ld, &C[(size_t)ib*ldc + jb], ldc);
+        continue;
+      }
+#endif
+      (void)block;
+      for (int i=ib; i<ib+4 && i<mb; i++) {
+        for (int j=(upper ? max(i, jb) : jb); j<jb+4 && j<pb; j++) {
+          if (int8) {
+            const int8_t* qa = &((const int8_t*)a->Q)[(size_t)(i0 + i)*ld];
+            const int8_t* qb = &((const int8_t*)b->Q)[(size_t)(j0 + j)*ld];
+            int64_t dot = pcc_dot_int8(qa, qb, b->qsum[j0 + j], ld);
+            C[(size_t)i*ldc + j] = (DataType)((double)a->qscale[i0 + i] * b->qscale[j0 + j] * dot);
+          } else {
+            const uint16_t* qa = &((const uint16_t*)a->Q)[(size_t)(i0 + i)*ld];
+            const uint16_t* qb = &((const uint16_t*)b->Q)[(size_t)(j0 + j)*ld];
+            C[(size_t)i*ldc + j] = (DataType)pcc_dot_bf16(qa, qb, ld);
+          }
         }
       }
     }
+  }
+}
 
-    GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
-         m, p, n, alpha, amask, n, bmask, n, beta, N, p);
+//PCC value from the sums over the nn pairwise complete elements, formed in double:
+// r = (N*SAB - SA*SB) / sqrt( (N*SAA - SA^2) * (N*SBB - SB^2) )
+//SAA and SBB hold rounded squares (float), so a variance term which is 0 in exact arithmetic (e.g. a
+// single pairwise complete observation) may come out slightly negative. The variance terms are clamped
+// at 0, pairs with less than 2 observations or without variance get 0 and |r| is clamped at 1.
+static inline DataType pcc_value(double nn, double sa, double sb, double saa, double sbb, double sab)
+{
+  double den = fmax(0., nn*saa - sa*sa) * fmax(0., nn*sbb - sb*sb);
+  double r = (nn > 1.5 && den > 0.) ? (nn*sab - sa*sb) / sqrt(den) : 0.;
+  return (DataType)fmin(1., fmax(-1., r));
+}
 
+//Full precision PCC of packed row ia of a and packed row jb of b, accumulated in double over the
+// pairwise complete observations. Used to rescore the candidate pairs of the reduced precision products.
+static DataType pcc_pair_exact(const pcc_rowset* a, int ia, const pcc_rowset* b, int jb, int n)
+{
+  int words = PCC_MASK_WORDS(n);
+  const DataType* x = &a->X[(size_t)ia*n];
+  const DataType* y = &b->X[(size_t)jb*n];
+  const uint64_t* ba = (ia < a->nfull) ? NULL : &a->bits[(size_t)(ia - a->nfull)*words];
+  const uint64_t* bb = (jb < b->nfull) ? NULL : &b->bits[(size_t)(jb - b->nfull)*words];
+  double nn = 0.0, sa = 0.0, sb = 0.0, saa = 0.0, sbb = 0.0, sab = 0.0;
+  for (int k=0; k<n; k++) {
+    if (ba != NULL && !((ba[k >> 6] >> (k & 63)) & 1)) continue;
+    if (bb != NULL && !((bb[k >> 6] >> (k & 63)) & 1)) continue;
+    nn += 1.0;
+    sa += x[k];
+    sb += y[k];
+    saa += (double)x[k]*x[k];
+    sbb += (double)y[k]*y[k];
+    sab += (double)x[k]*y[k];
+  }
+  return pcc_value(nn, sa, sb, saa, sbb, sab);
+}
 
-    //vsSqr(m*n,A,AA);
-    VSQR(m*n,A,AA);
+//Fused single pass assembly of an mb x pb block of PCC values from the GEMM terms (row stride pb).
+//Every term is read once per element and the result is written to P (row stride p):
+// P = (N*SAB - SA*SB) / sqrt( (N*SAA - SA^2) * (N*SBB - SB^2) )
+//Called by the threads that own the tiles, so the parallelism comes from the tile loop and
+// the inner loop is vectorized. When upper is set only the upper triangle (j >= i) is assembled,
+// as used for the diagonal tiles of the symmetric algorithm. P may alias SAB when p == pb.
+//The products and differences are formed in double, also when DataType is float.
+static inline void pcc_assemble(int mb, int pb,
+                                const DataType* N, const DataType* SA, const DataType* SB,
+                                const DataType* SAA, const DataType* SBB, const DataType* SAB,
+                                DataType* P, int p, bool upper)
+{
+  for (int i=0; i<mb; i++) {
+    const DataType* n_  = &N[i*pb];
+    const DataType* sa  = &SA[i*pb];
+    const DataType* sb  = &SB[i*pb];
+    const DataType* saa = &SAA[i*pb];
+    const DataType* sbb = &SBB[i*pb];
+    const DataType* sab = &SAB[i*pb];
+    DataType* r = &P[(size_t)i*p];
+    int j0 = upper ? i : 0;
+    #pragma omp simd
+    for (int j=j0; j<pb; j++) {
+      r[j] = pcc_value(n_[j], sa[j], sb[j], saa[j], sbb[j], sab[j]);
+    }
+  }
+}
 
-    //vsSqr(n*p,B,BB);
-    VSQR(n*p,B,BB);
+//Fill the mb x pb tile T with the per row values v (by_row) or the per column values v
+static inline void pcc_broadcast(int mb, int pb, const DataType* v, bool by_row, DataType* T)
+{
+  for (int i=0; i<mb; i++) {
+    #pragma omp simd
+    for (int j=0; j<pb; j++) T[i*pb + j] = by_row ? v[i] : v[j];
+  }
+}
 
-    //variables used for performance timing
-    //struct timespec startGEMM, stopGEMM;
-    //double accumGEMM;
+//Scatter the mb x pb tile R (row stride pb) to the original row and column positions in P.
+//For the symmetric algorithm both P[i,j] and P[j,i] are written, on diagonal tiles (upper)
+// only the upper triangle of R is valid.
+static inline void pcc_scatter(int mb, int pb, const DataType* R, const int* rows, const int* cols,
+                               DataType* P, int p, bool sym, bool upper)
+{
+  for (int i=0; i<mb; i++) {
+    DataType* r = &P[(size_t)rows[i]*p];
+    for (int j=(upper ? i : 0); j<pb; j++) {
+      r[cols[j]] = R[i*pb + j];
+      if (sym) P[(size_t)cols[j]*p + rows[i]] = R[i*pb + j];
+    }
+  }
+}
+
+//Significance of the PCC values: the t statistic t = r*sqrt((N-2)/(1-r^2)) with N-2 degrees of freedom
+// and its two sided p-value P(|T| >= |t|) = I_x(df/2, 1/2) with x = df/(df+t^2), the regularized
+// incomplete beta function. log(B(df/2, 1/2)) only depends on N, it is tabulated for N = 0..n upfront.
+struct pcc_stats {
+  DataType* N;      //m x p pairwise complete observations, or NULL
+  DataType* T;      //m x p t statistics, or NULL
+  DataType* Pval;   //m x p two sided p-values, or NULL
+  double* lbeta;    //lgamma(df/2 + 1/2) - lgamma(df/2) - lgamma(1/2) for N = 0..n
+};
+
+//Continued fraction of the incomplete beta function (modified Lentz)
+static double pcc_betacf(double a, double b, double x)
+{
+  const double tiny = 1e-300, eps = 1e-15;
+  double c = 1.0, d = 1.0 - (a + b) * x / (a + 1.0);
+  if (fabs(d) < tiny) d = tiny;
+  d = 1.0 / d;
+  double h = d;
+  for (int m=1; m<=1000; m++) {
+    double aa = m * (b - m) * x / ((a + 2*m - 1.0) * (a + 2*m));
+    d = 1.0 + aa * d; if (fabs(d) < tiny) d = tiny;
+    c = 1.0 + aa / c; if (fabs(c) < tiny) c = tiny;
+    d = 1.0 / d;
+    h *= d * c;
+    aa = -(a + m) * (a + b + m) * x / ((a + 2*m) * (a + 2*m + 1.0));
+    d = 1.0 + aa * d; if (fabs(d) < tiny) d = tiny;
+    c = 1.0 + aa / c; if (fabs(c) < tiny) c = tiny;
+    d = 1.0 / d;
+    double del = d * c;
+    h *= del;
+    if (fabs(del - 1.0) < eps) break;
+  }
+  return h;
+}
 
-    //info("before PCC terms\n",1);
+//Two sided p-value of the t statistic t with df degrees of freedom, lbeta = log(1/B(df/2, 1/2))
+static inline double pcc_pvalue(double t, double df, double lbeta)
+{
+  if (std::isnan(t)) return t;
+  double t2 = t * t;
+  if (std::isinf(t2)) return 0.0;
+  double a = 0.5 * df, b = 0.5;
+  double x = df / (df + t2), y = t2 / (df + t2); //x + y = 1 without cancellation
+  double front = exp(lbeta + a * log(x) + b * log(y));
+  if (x < (a + 1.0) / (a + b + 2.0)) return front * pcc_betacf(a, b, x) / a;
+  return 1.0 - front * pcc_betacf(b, a, y) / b;
+}
 
-    //Compute PCC terms and assemble
-     
+static bool pcc_stats_init(pcc_stats* stats, int n)
+{
+  stats->lbeta = (double*)mkl_malloc( (n + 1)*sizeof(double), 64 );
+  if (stats->lbeta == NULL) return false;
+  for (int k=0; k<=n; k++) {
+    double df = k - 2.0;
+    stats->lbeta[k] = (df > 0) ? lgamma(0.5 * df + 0.5) - lgamma(0.5 * df) - lgamma(0.5) : 0.0;
+  }
+  return true;
+}
 
-    CBLAS_TRANSPOSE transB=CblasNoTrans;
-    int ldb=p;
-    if(transposeB){
-      transB=CblasTrans;
-      ldb=n;
+//Significance of the mb x pb tile R (leading dimension ldr) of PCC values with N the tile of pairwise
+// complete counts (or NULL when all pairs have n observations), written to the original positions.
+//Pairs with less than 3 observations have no t statistic and p-value (NaN).
+static void pcc_stats_tile(const pcc_stats* stats, const pcc_rowset* a, int i0, int mb,
+                           const pcc_rowset* b, int j0, int pb, const DataType* R, int ldr,
+                           const DataType* N, int n, int p, bool sym, bool diag)
+{
+  for (int i=0; i<mb; i++) {
+    size_t gi = a->order[i0 + i];
+    for (int j=(diag ? i : 0); j<pb; j++) {
+      size_t gj = b->order[j0 + j];
+      int nn = (N != NULL) ? (int)N[i*pb + j] : n;
+      double r = R[(size_t)i*ldr + j];
+      double t = NAN, pval = NAN;
+      if (nn > 2) {
+        double df = nn - 2.0;
+        t = (fabs(r) >= 1.0) ? r * INFINITY : r * sqrt(df / (1.0 - r * r));
+        pval = pcc_pvalue(t, df, stats->lbeta[nn]);
+      }
+      if (stats->N != NULL) stats->N[gi*p + gj] = nn;
+      if (stats->T != NULL) stats->T[gi*p + gj] = t;
+      if (stats->Pval != NULL) stats->Pval[gi*p + gj] = pval;
+      if (sym) {
+        if (stats->N != NULL) stats->N[gj*p + gi] = nn;
+        if (stats->T != NULL) stats->T[gj*p + gi] = t;
+        if (stats->Pval != NULL) stats->Pval[gj*p + gi] = pval;
+      }
+    }
+  }
+}
+
+//Sparse output of the matrix algorithm. Instead of writing the tiles into a dense P, every tile is
+// filtered on the fly: only pairs with |r| >= threshold are kept, and with k > 0 only the k pairs
+// with the largest |r| of every row of A. Memory and output scale with the number of hits.
+struct pcc_sink {
+  DataType threshold;
+  int k;            //top-k partners per row of A, 0 keeps all pairs above the threshold
+  bool noself;      //skip pairs of a row with itself (A x A)
+  int* heap_j;      //top-k: per row of A (original order) a min heap on |r| of at most k pairs
+  DataType* heap_r;
+  DataType* heap_n;
+  int* heap_size;
+};
+
+//Pairs kept by one thread (threshold mode)
+struct pcc_sink_coo {
+  std::vector<int> i, j;
+  std::vector<DataType> r, n;
+};
+
+//Push pair (j, r, nn) into the min heap (on |r|) of row i
+static inline void pcc_sink_heap_push(const pcc_sink* sink, int i, int j, DataType r, DataType nn)
+{
+  int k = sink->k;
+  int* hj = &sink->heap_j[(size_t)i*k];
+  DataType* hr = &sink->heap_r[(size_t)i*k];
+  DataType* hn = &sink->heap_n[(size_t)i*k];
+  int size = sink->heap_size[i];
+  int c;
+  if (size < k) { //sift up
+    c = size++;
+    while (c > 0 && fabs(hr[(c-1)/2]) > fabs(r)) {
+      hj[c] = hj[(c-1)/2]; hr[c] = hr[(c-1)/2]; hn[c] = hn[(c-1)/2];
+      c = (c-1)/2;
+    }
+  } else { //replace the root and sift down
+    if (fabs(r) <= fabs(hr[0])) return;
+    c = 0;
+    for (;;) {
+      int child = 2*c + 1;
+      if (child >= k) break;
+      if (child + 1 < k && fabs(hr[child+1]) < fabs(hr[child])) child++;
+      if (fabs(hr[child]) >= fabs(r)) break;
+      hj[c] = hj[child]; hr[c] = hr[child]; hn[c] = hn[child];
+      c = child;
+    }
+  }
+  hj[c] = j; hr[c] = r; hn[c] = nn;
+  sink->heap_size[i] = size;
+}
+
+//Filter the mb x pb tile R (leading dimension pb) of PCC values, with N the tile of pairwise complete
+// counts or NULL when all pairs have n observations. Diagonal tiles of the symmetric algorithm only
+// hold the upper triangle, the pairs are stored with i < j.
+static void pcc_sink_tile(const pcc_sink* sink, pcc_sink_coo* coo,
+                          const pcc_rowset* a, int i0, int mb, const pcc_rowset* b, int j0, int pb,
+                          const DataType* R, const DataType* N, int n, bool sym, bool diag)
+{
+  for (int i=0; i<mb; i++) {
+    int gi = a->order[i0 + i];
+    for (int j=(diag ? i+1 : 0); j<pb; j++) {
+      DataType r = R[i*pb + j];
+      if (!(fabs(r) >= sink->threshold)) continue; //also drops NaN
+      int gj = b->order[j0 + j];
+      if (sink->noself && gi == gj) continue;
+      DataType nn = (N != NULL) ? N[i*pb + j] : (DataType)n;
+      if (sink->k > 0) {
+        pcc_sink_heap_push(sink, gi, gj, r, nn);
+      } else {
+        coo->i.push_back(sym ? min(gi, gj) : gi);
+        coo->j.push_back(sym ? max(gi, gj) : gj);
+        coo->r.push_back(r);
+        coo->n.push_back(nn);
+      }
+    }
+  }
+}
+
+//Computes the PCC values between the mb packed rows of a starting at i0 and the pb packed rows of b
+// starting at j0. Each range lies within one missingness class of its row set, which selects the formula:
+// complete x complete: a single GEMM of the standardized rows
+// otherwise: the terms SA, SB, SAA, SBB, SAB and N are computed with GEMMs and assembled. Terms which
+//  only depend on a complete side (e.g. SB, SBB and N when all rows of A are complete) are taken from
+//  the row statistics instead, so a complete x incomplete tile needs three GEMMs instead of six.
+//When sym is set a == b and only the upper triangle is needed, diagonal tiles then use SYRK.
+//When the rows are quantized SAB comes from the reduced precision products, also for complete x complete
+// tiles (with the row statistics as the other terms), and values with |r| >= rescore are recomputed
+// in full precision.
+//Results are written to P (row stride ldp) at the original row and column positions.
+static void pcc_rowset_tile(const pcc_rowset* a, int i0, int mb,
+                            const pcc_rowset* b, int j0, int pb, int n,
+                            DataType* P, int ldp, bool sym, pcc_tile_scratch* s,
+                            const pcc_sink* sink, pcc_sink_coo* coo, const pcc_stats* stats,
+                            DataType rescore)
+{
+  DataType alpha=1.0;
+  DataType beta=0.0;
+  bool fullA = (i0 < a->nfull);
+  bool fullB = (j0 < b->nfull);
+  bool diag = sym && (i0 == j0);
+  bool quant = (a->Q != NULL);
+
+  //write straight into P when the packed order is the original order, otherwise through the SAB tile
+  bool direct = !sym && a->identity && b->identity && (sink == NULL);
+  DataType* R = direct ? &P[(size_t)i0*ldp + j0] : s->SAB;
+  int ldr = direct ? ldp : pb;
+
+  if (fullA && fullB && !quant) {
+    //P = Za*Zb'
+    if (diag) {
+      SYRK(CblasRowMajor, CblasUpper, CblasNoTrans,
+           mb, n, alpha, &a->Z[(size_t)i0*n], n, beta, R, ldr);
+    } else {
+      GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+           mb, pb, n, alpha, &a->Z[(size_t)i0*n], n, &b->Z[(size_t)j0*n], n, beta, R, ldr);
+    }
+  } else {
+    const DataType* A = &a->X[(size_t)i0*n];
+    const DataType* AA = &a->XX[(size_t)i0*n];
+    const DataType* B = &b->X[(size_t)j0*n];
+    const DataType* BB = &b->XX[(size_t)j0*n];
+    int words = PCC_MASK_WORDS(n);
+    const uint64_t* bitsA = fullA ? NULL : &a->bits[(size_t)(i0 - a->nfull)*words];
+    const uint64_t* bitsB = fullB ? NULL : &b->bits[(size_t)(j0 - b->nfull)*words];
+
+    //expand the bit masks of the incomplete tile rows for the masked GEMMs
+    const DataType* UnitA = NULL;
+    const DataType* UnitB = NULL;
+    if (!fullA) {
+      pcc_expand_mask(mb, n, bitsA, s->UnitA);
+      UnitA = s->UnitA;
+    }
+    if (!fullB && !diag) {
+      pcc_expand_mask(pb, n, bitsB, s->UnitB);
+      UnitB = s->UnitB;
+    }
+    if (diag) UnitB = UnitA;
+
+    if (diag) {
+      //N = popcount(maskA & maskA), SAB = A*A' (upper triangle)
+      if (fullA) {
+        pcc_broadcast(mb, pb, &a->cnt[i0], true, s->N);
+      } else {
+        pcc_popcount_tile(mb, pb, words, bitsA, bitsA, s->N, true);
+      }
+      if (quant) {
+        pcc_quant_tile(a, i0, mb, b, j0, pb, s->SAB, pb, true);
+      } else {
+        SYRK(CblasRowMajor, CblasUpper, CblasNoTrans,
+             mb, n, alpha, A, n, beta, s->SAB, pb);
+      }
+    } else {
+      //N = popcount(maskA & maskB), number of pairwise complete observations for each AB row row pair
+      if (fullA) {
+        pcc_broadcast(mb, pb, &b->cnt[j0], false, s->N);
+      } else if (fullB) {
+        pcc_broadcast(mb, pb, &a->cnt[i0], true, s->N);
+      } else {
+        pcc_popcount_tile(mb, pb, words, bitsA, bitsB, s->N, false);
+      }
+
+      //SAB = A*B
+      if (quant) {
+        pcc_quant_tile(a, i0, mb, b, j0, pb, s->SAB, pb, false);
+      } else {
+        GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+             mb, pb, n, alpha, A, n, B, n, beta, s->SAB, pb); 
+      }
     }
 
-    //clock_gettime(CLOCK_MONOTONIC, &startGEMM);
-    
     //SA = A*UnitB
     //Compute sum of A for each AB row col pair.
     // This requires multiplication with a UnitB matrix which acts as a mask 
     // to prevent missing data in AB pairs from contributing to the sum
-    //cblas_sgemm(CblasRowMajor, CblasNoTrans, transB,
-    GEMM(CblasRowMajor, CblasNoTrans, transB,
-         m, p, n, alpha, A, n, UnitB, ldb, beta, SA, p); 
+    //SAA = AA*UnitB
+    //Compute sum of AA for each AB row col pair.
+    if (fullB) {
+      pcc_broadcast(mb, pb, &a->sum[i0], true, s->SA);
+      pcc_broadcast(mb, pb, &a->sumsq[i0], true, s->SAA);
+    } else {
+      GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+           mb, pb, n, alpha, A, n, UnitB, n, beta, s->SA, pb); 
+      GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+           mb, pb, n, alpha, AA, n, UnitB, n, beta, s->SAA, pb); 
+    }
 
-    //SB = B*UnitA
+    //SB = UnitA*B
     //Compute sum of B for each AB row col pair.
-    // This requires multiplication with a UnitA matrix which acts as a mask 
-    // to prevent missing data in AB pairs from contributing to the sum
-    //cblas_sgemm(CblasRowMajor, CblasNoTrans, transB,
-    GEMM(CblasRowMajor, CblasNoTrans, transB,
-         m, p, n, alpha, UnitA, n, B, ldb, beta, SB, p); 
+    //SBB = UnitA*BB
+    //Compute sum of BB for each AB row col pair.
+    if (diag) {
+      //SB = SA', SBB = SAA' (only the upper triangle is used by the assembly)
+      for (int i=0; i<mb; i++) {
+        for (int j=i; j<pb; j++) {
+          s->SB[i*pb + j]  = s->SA[j*pb + i];
+          s->SBB[i*pb + j] = s->SAA[j*pb + i];
+        }
+      }
+    } else if (fullA) {
+      pcc_broadcast(mb, pb, &b->sum[j0], false, s->SB);
+      pcc_broadcast(mb, pb, &b->sumsq[j0], false, s->SBB);
+    } else {
+      GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+           mb, pb, n, alpha, UnitA, n, B, n, beta, s->SB, pb); 
+      GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+           mb, pb, n, alpha, UnitA, n, BB, n, beta, s->SBB, pb); 
+    }
 
+    //Compute and assemble composite terms (in place into SAB if not direct)
+    pcc_assemble(mb, pb, s->N, s->SA, s->SB, s->SAA, s->SBB, s->SAB, R, ldr, diag);
+  }
 
-    //SAA = AA*UnitB
-    //Compute sum of AA for each AB row col pair.
-    // This requires multiplication with a UnitB matrix which acts as a mask 
-    // to prevent missing data in AB pairs from contributing to the sum
-    //cblas_sgemm(CblasRowMajor, CblasNoTrans, transB,
-    GEMM(CblasRowMajor, CblasNoTrans, transB,
-         m, p, n, alpha, AA, n, UnitB, ldb, beta, SAA, p); 
+  if (quant && rescore <= 1.0) {
+    for (int i=0; i<mb; i++) {
+      for (int j=(diag ? i : 0); j<pb; j++) {
+        if (fabs(R[(size_t)i*ldr + j]) >= rescore) R[(size_t)i*ldr + j] = pcc_pair_exact(a, i0 + i, b, j0 + j, n);
+      }
+    }
+  }
 
-    //SBB = BB*UnitA
-    //Compute sum of BB for each AB row col pair.
-    // This requires multiplication with a UnitA matrix which acts as a mask 
-    // to prevent missing data in AB pairs from contributing to the sum
-    //cblas_sgemm(CblasRowMajor, CblasNoTrans, transB,
-    GEMM(CblasRowMajor, CblasNoTrans, transB,
-         m, p, n, alpha, UnitA, n, BB, ldb, beta, SBB, p); 
-
-    mkl_free(UnitA);
-    mkl_free(UnitB);
-    mkl_free(AA);
-    mkl_free(BB);
-
-    //SAB = A*B
-    //cblas_sgemm(CblasRowMajor, CblasNoTrans, transB,
-    GEMM(CblasRowMajor, CblasNoTrans, transB,
-         m, p, n, alpha, A, n, B, ldb, beta, SAB, p); 
-
-    //clock_gettime(CLOCK_MONOTONIC, &stopGEMM);
-    //accumGEMM =  (TimeSpecToSeconds(&stopGEMM)- TimeSpecToSeconds(&startGEMM));
-    //printf("All(5) GEMMs (%e)s GFLOPs=%e \n", accumGEMM, 5*(2/1.0e9)*m*n*p/accumGEMM);
-
-    DataType* SASB = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 );
-    DataType* NSAB = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); //ceb
-   
-    DataType* SASA = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); 
-    DataType* NSAA = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); //ceb
-    
-    DataType* SBSB = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 );    
-    DataType* NSBB = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); //ceb   
-    
-    DataType* DENOM = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 );
-    DataType* DENOMSqrt =( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); 
-
-    //Compute and assemble composite terms
-
-    //SASB=SA*SB
-    VMUL(m*p,SA,SB,SASB);
-    //N*SASB
-    VMUL(m*p,N,SAB,NSAB); //ceb
-
-    //NSAB=(-1)NSASB+SAB  (numerator)
-    AXPY(m*p,(DataType)(-1), SASB,1, NSAB,1); //ceb
-
-    //(SA)^2
-    VSQR(m*p,SA,SASA);
-    //N(SAA)
-    VMUL(m*p,N,SAA,NSAA); //ceb
-    //NSAA=NSAA-SASA (denominator term 1)
-    AXPY(m*p,(DataType)(-1), SASA,1, NSAA,1);
-
-    //(SB)^2
-    VSQR(m*p,SB,SBSB);
-    //N(SBB)
-    VMUL(m*p,N,SBB,NSBB);
-    //NSBB=NSBB-SBSB (denominatr term 2)
-    AXPY(m*p,(DataType)(-1), SBSB,1, NSBB,1);
-
-    //DENOM=NSAA*NSBB (element wise multiplication)
-    VMUL(m*p,NSAA,NSBB,DENOM);
-    for(int i=0;i<m*p;++i){
-       if(DENOM[i]==0.){DENOM[i]=1;}//numerator will be 0 so to prevent inf, set denom to 1
-    }
-    //sqrt(DENOM)
-    VSQRT(m*p,DENOM,DENOMSqrt);
-    //P=NSAB/DENOMSqrt (element wise division)
-    VDIV(m*p,NSAB,DENOMSqrt,P);   
-
-    mkl_free(SASB);
-    mkl_free(NSAB);
-    mkl_free(SASA);
-    mkl_free(NSAA);
-    mkl_free(SBSB);
-    mkl_free(NSBB);
-    mkl_free(DENOM);
-    mkl_free(DENOMSqrt); 
-  }
-
-  mkl_free(N);
-  mkl_free(SA);
-  mkl_free(SAA);
-  mkl_free(SB);
-  mkl_free(SBB);
-  mkl_free(SAB);
+  if (stats != NULL) {
+    pcc_stats_tile(stats, a, i0, mb, b, j0, pb, R, ldr, (fullA && fullB) ? NULL : s->N, n, ldp, sym, diag);
+  }
+  if (sink != NULL) {
+    pcc_sink_tile(sink, coo, a, i0, mb, b, j0, pb, R, (fullA && fullB) ? NULL : s->N, n, sym, diag);
+  } else if (!direct) {
+    pcc_scatter(mb, pb, R, &a->order[i0], &b->order[j0], P, ldp, sym, diag);
+  }
+}
 
-  return 0;
-};
+//Copy the upper triangle of the m x m matrix P (row stride ldp) into its lower triangle,
+// blocked to keep the transposed reads in cache. Called from inside a parallel region.
+static void pcc_mirror_upper(int m, DataType* P, int ldp)
+{
+  int mtiles = (m + PCC_TILE_M - 1) / PCC_TILE_M;
+  #pragma omp for collapse(2) schedule(dynamic)
+  for (int ib=0; ib<mtiles; ib++) {
+    for (int jb=0; jb<mtiles; jb++) {
+      if (jb > ib) continue;
+      int i0 = ib*PCC_TILE_M;
+      int j0 = jb*PCC_TILE_M;
+      int iend = (m - i0 < PCC_TILE_M) ? m : i0 + PCC_TILE_M;
+      int jend = (m - j0 < PCC_TILE_M) ? m : j0 + PCC_TILE_M;
+      for (int i=i0; i<iend; i++) {
+        for (int j=j0; j<jend && j<i; j++) {
+          P[(size_t)i*ldp + j] = P[(size_t)j*ldp + i];
+        }
+      }
+    }
+  }
+}
+
+//Workspace bytes of pcc_rowset_run for rowsA x rowsB tiles with the current number of threads
+static size_t pcc_rowset_run_bytes(int rowsA, int rowsB, int n){
+  int tileB = (PCC_TILE_P < PCC_TILE_M) ? PCC_TILE_P : PCC_TILE_M;
+#ifdef _OPENMP
+  int threads = omp_get_max_threads();
+#else
+  int threads = 1;
+#endif
+  return 2*pcc_round64((rowsA/PCC_TILE_M + 2)*sizeof(int)) + 2*pcc_round64((rowsB/tileB + 2)*sizeof(int)) +
+         (size_t)threads*pcc_tile_scratch_bytes(n);
+}
 
+//Tile driver shared by pcc_matrix and pcc_matrix_sym. Walks the output in tiles (upper triangle
+// of tiles only when sym is set), tiles are distributed over the OpenMP threads and each thread
+// runs its GEMMs and the assembly on its own tile sized scratch buffers.
+//With mem the tile lists and the scratch of every thread are carved from the workspace at *mem (of at
+// least pcc_rowset_run_bytes bytes), thread t uses the t-th block of pcc_tile_scratch_bytes(n) bytes.
+//P has row stride ldp. Returns false if the scratch buffers could not be allocated.
+static bool pcc_rowset_run(const pcc_rowset* a, const pcc_rowset* b, int n,
+                           DataType* P, int ldp, bool sym,
+                           const pcc_sink* sink = NULL, pcc_sink_coo* coo = NULL,
+                           const pcc_stats* stats = NULL, DataType rescore = PCC_NO_RESCORE,
+                           char** mem = NULL)
+{
+  int tileM = PCC_TILE_M;
+  int tileP = sym ? PCC_TILE_M : PCC_TILE_P;
+  int* startsA = (int*)pcc_alloc(mem, (a->rows/tileM + 2)*sizeof(int));
+  int* sizesA  = (int*)pcc_alloc(mem, (a->rows/tileM + 2)*sizeof(int));
+  int* startsB = (int*)pcc_alloc(mem, (b->rows/tileP + 2)*sizeof(int));
+  int* sizesB  = (int*)pcc_alloc(mem, (b->rows/tileP + 2)*sizeof(int));
+  bool failed = (startsA == NULL) | (sizesA == NULL) | (startsB == NULL) | (sizesB == NULL);
+  char* scratch = (mem != NULL) ? *mem : NULL;
+
+  if (!failed) {
+    int mtiles = pcc_rowset_tiles(a, tileM, startsA, sizesA);
+    int ptiles = pcc_rowset_tiles(b, tileP, startsB, sizesB);
+
+    #pragma omp parallel
+    {
+      pcc_tile_scratch s;
+#ifdef _OPENMP
+      int thread = omp_get_thread_num();
+#else
+      int thread = 0;
 #endif
+      char* mine = (scratch != NULL) ? scratch + (size_t)thread*pcc_tile_scratch_bytes(n) : NULL;
+      bool ok = pcc_tile_scratch_alloc(&s, n, (mine != NULL) ? &mine : NULL);
+      if (!ok) {
+        #pragma omp atomic write
+        failed = true;
+      }
+      #pragma omp barrier
+
+      pcc_sink_coo local;
+      if (!failed && sink != NULL && sink->k > 0) {
+        //top-k: a row of tiles per thread, so that every heap is owned by one thread
+        #pragma omp for schedule(dynamic)
+        for (int ib=0; ib<mtiles; ib++) {
+          for (int jb=0; jb<ptiles; jb++) {
+            pcc_rowset_tile(a, startsA[ib], sizesA[ib], b, startsB[jb], sizesB[jb], n,
+                            P, ldp, sym, &s, sink, NULL, stats, rescore);
+          }
+        }
+      } else if (!failed) {
+        #pragma omp for collapse(2) schedule(dynamic)
+        for (int ib=0; ib<mtiles; ib++) {
+          for (int jb=0; jb<ptiles; jb++) {
+            if (sym && jb < ib) continue; //lower triangle is mirrored
+            pcc_rowset_tile(a, startsA[ib], sizesA[ib], b, startsB[jb], sizesB[jb], n,
+                            P, ldp, sym, &s, sink, &local, stats, rescore);
+          }
+        }
+      }
+      if (coo != NULL && !local.i.empty()) {
+        #pragma omp critical
+        {
+          coo->i.insert(coo->i.end(), local.i.begin(), local.i.end());
+          coo->j.insert(coo->j.end(), local.j.begin(), local.j.end());
+          coo->r.insert(coo->r.end(), local.r.begin(), local.r.end());
+          coo->n.insert(coo->n.end(), local.n.begin(), local.n.end());
+        }
+      }
+      pcc_tile_scratch_free(&s);
+    }
+  }
+
+  if (mem == NULL) {
+    mkl_free(startsA);
+    mkl_free(sizesA);
+    mkl_free(startsB);
+    mkl_free(sizesB);
+  }
+  return !failed;
+}
+
+//Persistent workspace of pcc_matrix and pcc_matrix_sym. The packed row sets, the tile lists and the
+// tile scratch of every thread are carved from one buffer, which is kept across calls and only grows.
+//Every buffer in it is fully written before it is read (the bit masks are cleared explicitly), so the
+// workspace is not zero filled. Its pages are not touched when it is allocated either: the first call
+// places every page on the NUMA node of the thread which first writes it (packing loops, per thread
+// scratch), later calls reuse the mapped pages without page faults.
+size_t pcc_workspace_bytes(int m, int n, int p){
+  bool sym = (p == 0);
+  return pcc_rowset_bytes(m, n) + (sym ? 0 : pcc_rowset_bytes(p, n)) + pcc_rowset_run_bytes(m, sym ? m : p, n);
+}
+
+bool pcc_workspace_reserve(pcc_workspace* ws, size_t bytes){
+  if (bytes <= ws->bytes) return true;
+  bytes = max(bytes, ws->bytes + ws->bytes / 2); //grow geometrically when the problems grow slowly
+  mkl_free(ws->mem);
+  ws->mem = (char*)mkl_malloc( bytes, 64 );
+  ws->bytes = (ws->mem != NULL) ? bytes : 0;
+  return (ws->mem != NULL);
+}
 
-#ifndef NOMKL
-#ifdef PCC_VECTOR
+void pcc_workspace_free(pcc_workspace* ws){
+  mkl_free(ws->mem);
+  ws->mem = NULL;
+  ws->bytes = 0;
+}
 
-//This function uses bit arithmetic to mask vectors prior to performing a number of FMA's
-//The intention is to improve upon the matrix x matrix missing data PCC algorithm by reducing uneccessary computations
-// and maximizing the use of vector register arithmetic.
+//This function is the implementation of a matrix x matrix algorithm which computes a matrix of PCC values
+//but increases the arithmetic intensity of the naive pairwise vector x vector correlation
 //A is matrix of X vectors and B is transposed matrix of Y vectors:
-//P = [ N*sum(AB) - (sumA)(sumB)] /
-//    sqrt[ (N sumA^2 -(sum A)^2)[ ( N sumB^2 - (sum B)^2) ]
-//P = (N*SAB - SA*SB)/Sqrt( (N*SAA - (SA)^2) * (N*SBB - (SB)^2)  )
+//P = [ sum(AB) - (sumA)(sumB)/N] /
+//    sqrt[ ( sumA^2 -(1/N) (sum A/)^2)[ ( sumB^2 - (1/N)(sum B)^2) ]
+//The rows of A and B are partitioned into complete rows and rows with missing values. Blocks of
+// complete x complete rows use a single GEMM on standardized rows, only blocks which touch incomplete
+// rows use the masked multi GEMM formula. The output is computed in PCC_TILE_M x PCC_TILE_P tiles
+// and scattered back into P in the original order.
+//With ws all intermediate buffers are carved from the (grown when needed) workspace instead of being allocated.
+//Row i of A starts at A[i*lda] with its elements inca apart (B likewise), the rows of P are ldp apart.
+static int pcc_matrix_ld(int m, int n, int p, const DataType* A, int lda, int inca,
+                         const DataType* B, int ldb, int incb, DataType* P, int ldp, pcc_workspace* ws)
+{
+  char* mem = NULL;
+  if (ws != NULL && pcc_workspace_reserve(ws, pcc_workspace_bytes(m, n, p))) mem = ws->mem;
+  char** pmem = (mem != NULL) ? &mem : NULL; //allocate the buffers one by one when the workspace can't grow
 
-int pcc_vector(int m, int n, int p,
-	       DataType* A, DataType* B, DataType* P)	       
+  //plan the missing data and pack A and B, the inputs are not modified
+  pcc_rowset a, b;
+  bool okA = pcc_rowset_init(&a, m, n, A, pmem, NULL, lda, inca);
+  bool okB = pcc_rowset_init(&b, p, n, B, pmem, NULL, ldb, incb);
+
+  //if any of the above allocations failed, then we have run out of RAM on the node and we need to abort
+  if (!okA || !okB) {
+    printf( "\n ERROR: Can't allocate memory for intermediate matrices. Aborting... \n\n");
+    pcc_rowset_free(&a);
+    pcc_rowset_free(&b);
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
+  } 
+
+  bool ok = true;
+  if (a.nfull == m && b.nfull == p) {
+    //no missing data: N is the constant n and the sums reduce to row statistics, so
+    // P is a single GEMM of the standardized rows
+    GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+         m, p, n, (DataType)1.0, a.Z, n, b.Z, n, (DataType)0.0, P, ldp);
+  } else {
+    ok = pcc_rowset_run(&a, &b, n, P, ldp, false, NULL, NULL, NULL, PCC_NO_RESCORE, pmem);
+  }
+
+  pcc_rowset_free(&a);
+  pcc_rowset_free(&b);
+
+  if (!ok) {
+    printf( "\n ERROR: Can't allocate memory for tile scratch buffers. Aborting... \n\n");
+    #ifndef USING_R
+    exit (0);
+    #endif
+  }
+
+  return 0;
+};
+
+//Symmetric (auto-correlation) version of pcc_matrix for A == B, computes the m x m matrix P of
+//PCC values between all row pairs of A. The rows of A are planned and packed once, only the tiles
+//on and above the diagonal are computed (diagonal tiles with SYRK), and every value is written to
+//both P[i,j] and P[j,i]. This roughly halves the FLOPs of pcc_matrix(A, A).
+//Strides as in pcc_matrix_ld.
+static int pcc_matrix_sym_ld(int m, int n, const DataType* A, int lda, int inca,
+                             DataType* P, int ldp, pcc_workspace* ws)
 {
-  int i,j,k;
-  int stride = ((n-1)/64 +1);
-  DataType alpha=1.0;
-  DataType beta=0.0;
-  int count =1;
+  char* mem = NULL;
+  if (ws != NULL && pcc_workspace_reserve(ws, pcc_workspace_bytes(m, n, 0))) mem = ws->mem;
+  char** pmem = (mem != NULL) ? &mem : NULL;
 
-  bool transposeB = true; //assume this is always true. 
+  //plan the missing data and pack A
+  pcc_rowset a;
+  bool okA = pcc_rowset_init(&a, m, n, A, pmem, NULL, lda, inca);
 
-  //we need to compute terms using FMA and masking and then assemble terms to 
-  // construct the PCC value for each row column pair
+  //if any of the above allocations failed, then we have run out of RAM on the node and we need to abort
+  if (!okA) {
+    printf( "\n ERROR: Can't allocate memory for intermediate matrices. Aborting... \n\n");
+    pcc_rowset_free(&a);
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
+  } 
 
-  unsigned long zeros = 0;
-  unsigned long ones = ~0; //bitwise complement of 0 is all 1's (maxint)
+  bool ok = true;
+  if (a.nfull == m) {
+    //no missing data: a single SYRK of the standardized rows for the upper triangle, then mirror
+    SYRK(CblasRowMajor, CblasUpper, CblasNoTrans,
+         m, n, (DataType)1.0, a.Z, n, (DataType)0.0, P, ldp);
+    #pragma omp parallel
+    {
+      pcc_mirror_upper(m, P, ldp);
+    }
+  } else {
+    ok = pcc_rowset_run(&a, &a, n, P, ldp, true, NULL, NULL, NULL, PCC_NO_RESCORE, pmem);
+  }
 
-  //We wamt to perform operations on vectors of float or double precision values. 
-  //By constructing a mask in the form of a vector of floats or doubles, in which 
-  // the values we want to keep are masked by a number which translates to a 111..1 (i.e. maxint for 32 or 64 bit values),
-  // and the values we want to ignore are masked by a 000..0 bit string, we can simply apply a bitwise AND
-  // to get a resultant vector on which we can perform an FMA operation
+  pcc_rowset_free(&a);
 
-  //We also want to use this bitmask to compute a sum of non-missing data for each row-column pair
+  if (!ok) {
+    printf( "\n ERROR: Can't allocate memory for tile scratch buffers. Aborting... \n\n");
+    #ifndef USING_R
+    exit (0);
+    #endif
+  }
 
-  //We can create a bitmask for both A and B matrices by doing the following:
-  //  Initialize an Amask and Bmask matrix to all 1 bit strings. While reading A or B, 
-  //  where there is a Nan bit string in A or B, place a 0 bit string in the corresponding mask matrix
+  return 0;
+};
 
-  //To compute the various terms, eg, sum of A, for i=1..m, j=1..p, SA[i,j] = Sum_k(A[i] & Bmask[j]) 
-  // reduce (sum) operation will have to be hand coded via openMP parallel reduce with pragma simd inside loop
-  // horizontal_add returns sum of components of vector but is not efficient. Breaks SIMD ideal
- 
+int pcc_matrix(int m, int n, int p,
+               const DataType* A, const DataType* B, DataType* P, pcc_workspace* ws)
+{
+  return pcc_matrix_ld(m, n, p, A, n, 1, B, n, 1, P, p, ws);
+}
 
+int pcc_matrix_sym(int m, int n, const DataType* A, DataType* P, pcc_workspace* ws)
+{
+  return pcc_matrix_sym_ld(m, n, A, n, 1, P, m, ws);
+}
 
-  //How to create Amask and Bmask
-  //In the process of creating masks for A and B we can either replace Nans with 0 as we go in A and B, or we can then apply the masks to 
-  // to the matrices after we compute them.
+//BLAS style interface of pcc_matrix: op(A) (m x n) and op(B) (p x n) hold the variables in their rows,
+// where op(X) is X or its transpose (trans), in the row or column major layout with leading dimensions
+// lda and ldb. P is the m x p result in the same layout with leading dimension ldp, B == NULL gives the
+// symmetric m x m result of A (transB and ldb are ignored). Sub matrices of larger matrices (R matrices,
+// memory mapped files) are used in place: the strides go straight into the packing pass of the matrix
+// algorithm, which reads every element once, there is no separate copy of the inputs.
+//A column major result is computed as the row major transposed result (cor(B, A)).
+int pcc_matrix_strided(int layout, int transA, int transB, int m, int n, int p,
+                       const DataType* A, int lda, const DataType* B, int ldb, DataType* P, int ldp,
+                       pcc_workspace* ws)
+{
+  bool sym = (B == NULL);
+  bool row = (layout == PCC_ROW_MAJOR);
+  if (sym) p = m;
+  //a variable is contiguous when its row of op(X) is a row of the row major X or a column of the column major X'
+  bool contA = (row == (transA == PCC_NO_TRANS));
+  bool contB = (row == (transB == PCC_NO_TRANS));
+  if ( (layout != PCC_ROW_MAJOR && layout != PCC_COL_MAJOR) | (m < 0) | (n < 0) | (p < 0) |
+       (lda < max(1, contA ? n : m)) | (!sym && ldb < max(1, contB ? n : p)) | (ldp < max(1, row ? p : m)) ) {
+    printf( "\n ERROR: Invalid layout, dimensions or leading dimensions in pcc_matrix_strided. Aborting... \n\n");
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
+  }
+  int inca = contA ? 1 : lda, incb = contB ? 1 : ldb;
+  if (!contA) lda = 1;
+  if (!contB) ldb = 1;
 
-  // We can create a matrix mask starting with a mask matrix containing all maxint bit strings except where A has missing data in which case the mask will contain a zero.
-  // We can set these mask values to zero in the appropriate locations by traversing A or B and applying the isnan function in an if statement. 
-  // If false, then set Amask or Bmask respectively to ones at that location (masks initialized to zeros)
-  // (there may be a more efficent way to do this)
-  
-  DataType* Amask = ( DataType*)mkl_calloc( m*n, sizeof(DataType), 64 );
-  __assume_aligned(Amask, 64);
-  for(i=0; i<m*n; ++i){
-     if(isnan(A[i])){ A[i]=0;}
-     else{Amask[i]=ones;}
+  if (sym) return pcc_matrix_sym_ld(m, n, A, lda, inca, P, ldp, ws);
+  if (row) return pcc_matrix_ld(m, n, p, A, lda, inca, B, ldb, incb, P, ldp, ws);
+  return pcc_matrix_ld(p, n, m, B, ldb, incb, A, lda, inca, P, ldp, ws);
+}
+
+void pcc_sparse_free(pcc_sparse* S)
+{
+  mkl_free(S->i); mkl_free(S->j); mkl_free(S->r); mkl_free(S->n);
+  S->i = S->j = NULL; S->r = S->n = NULL; S->nnz = 0;
+}
+
+static bool pcc_sparse_alloc(pcc_sparse* S, size_t nnz)
+{
+  S->nnz = nnz;
+  S->i = (int*)mkl_malloc( (nnz > 0 ? nnz : 1)*sizeof(int), 64 );
+  S->j = (int*)mkl_malloc( (nnz > 0 ? nnz : 1)*sizeof(int), 64 );
+  S->r = (DataType*)mkl_malloc( (nnz > 0 ? nnz : 1)*sizeof(DataType), 64 );
+  S->n = (DataType*)mkl_malloc( (nnz > 0 ? nnz : 1)*sizeof(DataType), 64 );
+  return (S->i != NULL) & (S->j != NULL) & (S->r != NULL) & (S->n != NULL);
+}
+
+//Sparse version of pcc_matrix, returns the pairs (i, j, r, n) of rows of A and B with |r| >= threshold
+// in S (COO, sorted by i then j), n is the number of pairwise complete observations. With k > 0 only
+// the k pairs with the largest |r| are kept for every row of A (sorted by i then decreasing |r|).
+//When B is NULL the correlations between the rows of A are computed: pairs of a row with itself are
+// skipped, and without k every pair is reported once (i < j) using the symmetric algorithm.
+//The dense m x p result is never formed, only one tile per thread.
+//With a reduced precision the candidate pairs with |r| >= rescore are recomputed in full precision before
+// they are filtered, so a rescore a bit below the threshold returns exact values for (nearly) all pairs.
+int pcc_matrix_sparse(int m, int n, int p, const DataType* A, const DataType* B,
+                      DataType threshold, int k, pcc_sparse* S, int precision, DataType rescore)
+{
+  S->i = S->j = NULL; S->r = S->n = NULL; S->nnz = 0;
+  bool sym = (B == NULL) && (k <= 0);
+  if (B == NULL) p = m;
+
+  pcc_rowset a, b;
+  bool okA = pcc_rowset_init(&a, m, n, A);
+  bool okB = (B == NULL) ? true : pcc_rowset_init(&b, p, n, B);
+  if (precision != PCC_PRECISION_FULL) {
+    okA = okA && pcc_rowset_quantize(&a, n, precision);
+    okB = okB && ((B == NULL) || pcc_rowset_quantize(&b, n, precision));
+  }
+
+  pcc_sink sink;
+  sink.threshold = threshold;
+  sink.k = (k > 0) ? min(k, p) : 0;
+  sink.noself = (B == NULL);
+  sink.heap_j = NULL; sink.heap_r = NULL; sink.heap_n = NULL; sink.heap_size = NULL;
+  if (sink.k > 0) {
+    sink.heap_j = (int*)mkl_malloc( ((size_t)m*sink.k > 0 ? (size_t)m*sink.k : 1)*sizeof(int), 64 );
+    sink.heap_r = (DataType*)mkl_malloc( ((size_t)m*sink.k > 0 ? (size_t)m*sink.k : 1)*sizeof(DataType), 64 );
+    sink.heap_n = (DataType*)mkl_malloc( ((size_t)m*sink.k > 0 ? (size_t)m*sink.k : 1)*sizeof(DataType), 64 );
+    sink.heap_size = (int*)mkl_calloc( (m > 0 ? m : 1), sizeof(int), 64 );
+    if ( (sink.heap_j == NULL) | (sink.heap_r == NULL) | (sink.heap_n == NULL) | (sink.heap_size == NULL) ) okA = false;
   }
 
-  DataType* Bmask = ( DataType*)mkl_calloc( n*p, sizeof(DataType), 64 );
-  __assume_aligned(Bmask, 64);    
-  for(i=0; i<p*n; ++i){
-     if(isnan(B[i])){ B[i]=0;}
-     else{Bmask[i]=ones;}
+  bool ok = okA && okB;
+  pcc_sink_coo coo;
+  if (ok) ok = pcc_rowset_run(&a, (B == NULL) ? &a : &b, n, NULL, p, sym, &sink, &coo, NULL, rescore);
+
+  if (ok && sink.k > 0) {
+    //sort the heap of every row on decreasing |r| and concatenate the rows
+    size_t nnz = 0;
+    for (int i=0; i<m; i++) nnz += sink.heap_size[i];
+    ok = pcc_sparse_alloc(S, nnz);
+    size_t offset = 0;
+    for (int i=0; ok && i<m; i++) {
+      int size = sink.heap_size[i];
+      std::vector<int> order(size);
+      for (int e=0; e<size; e++) order[e] = e;
+      const int* hj = &sink.heap_j[(size_t)i*sink.k];
+      const DataType* hr = &sink.heap_r[(size_t)i*sink.k];
+      const DataType* hn = &sink.heap_n[(size_t)i*sink.k];
+      std::sort(order.begin(), order.end(), [&](int x, int y) {
+        return (fabs(hr[x]) != fabs(hr[y])) ? (fabs(hr[x]) > fabs(hr[y])) : (hj[x] < hj[y]);
+      });
+      for (int e=0; e<size; e++) {
+        S->i[offset + e] = i;
+        S->j[offset + e] = hj[order[e]];
+        S->r[offset + e] = hr[order[e]];
+        S->n[offset + e] = hn[order[e]];
+      }
+      offset += size;
+    }
+  } else if (ok) {
+    //counting sort of the pairs on i, then sort every row on j
+    size_t nnz = coo.i.size();
+    ok = pcc_sparse_alloc(S, nnz);
+    std::vector<size_t> start(m + 1, 0);
+    for (size_t e=0; ok && e<nnz; e++) start[coo.i[e] + 1]++;
+    for (int i=0; i<m; i++) start[i+1] += start[i];
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    std::vector<size_t> perm(ok ? nnz : 0);
+    for (size_t e=0; ok && e<nnz; e++) perm[fill[coo.i[e]]++] = e;
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i=0; i<(ok ? m : 0); i++) {
+      std::sort(perm.begin() + start[i], perm.begin() + start[i+1],
+                [&](size_t x, size_t y) { return coo.j[x] < coo.j[y]; });
+      for (size_t e=start[i]; e<start[i+1]; e++) {
+        S->i[e] = i;
+        S->j[e] = coo.j[perm[e]];
+        S->r[e] = coo.r[perm[e]];
+        S->n[e] = coo.n[perm[e]];
+      }
+    }
   }
 
-  //The masks can then be used by employing a bitwise (AND) &, between the elements of the mask and the elements of the matrix or vector we want to mask. 
-  // The elements masked with a zero bit string will return a zero, the elements masked with the 1 bit string will return the original element.
+  mkl_free(sink.heap_j); mkl_free(sink.heap_r); mkl_free(sink.heap_n); mkl_free(sink.heap_size);
+  pcc_rowset_free(&a);
+  if (B != NULL) pcc_rowset_free(&b);
 
-  
-  //How to compute N?
-  // N[i,j] contains the number of valid pairs (no Nan's) of elements when comparing rows A[i] and B[j].
-  // If we apply a bitwise (AND) & to compare rows A[i] and B[j] the result will be a bit vector of 1's for all element 
-  // comparisons that don't include Nan's and zero's elsewhere. To sum up the valid element pairs, we could simply loop over the 
-  // resulting vector and count up the maxints.
-  //(There may be a faster way to sum values for N using bit ops)
-
-  //N contains the number of elements used in each row column PCC calculation (after missing values are removed)
-  DataType *N = (DataType *) mkl_calloc( m*p,sizeof( DataType ), 64 );
-  __assume_aligned(N, 64);
-  for(i=0; i<m; ++i){
-     for(j=0; j<p; ++j){
-        for(k=0; k<n; ++k){
-           //if( (Amask[i*n+k] & Bmask[j*n+k]) > 0  ){ N[i*p+j]++; }  
-           unsigned long* A_bitstring = reinterpret_cast<unsigned long* >(&(Amask[i*n+k]));  
-           unsigned long* B_bitstring = reinterpret_cast<unsigned long* >(&(Bmask[j*n+k]));
-           unsigned long C_bitstring = *A_bitstring & *B_bitstring;
-           if( C_bitstring > 0){ N[i*p+j]++;}
-        }
-     }
+  if (!ok) {
+    pcc_sparse_free(S);
+    printf( "\n ERROR: Can't allocate memory for intermediate matrices. Aborting... \n\n");
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
   }
+  return 0;
+};
 
+//The matrix algorithm with N, t and p-values of every pair, computed per tile right after the PCC values
+// while they are in cache. Always runs the tiled path, the counts N are a by-product of its GEMMs.
+int pcc_matrix_stats(int m, int n, int p, const DataType* A, const DataType* B, DataType* P,
+                     DataType* N, DataType* T, DataType* Pval)
+{
+  bool sym = (B == NULL);
+  if (sym) p = m;
 
-  //After computing masks and N, we want to replace Nan's in A and B with 0.
-  // We can do this by masking A with Amask and B with Bmask 
+  pcc_rowset a, b;
+  bool okA = pcc_rowset_init(&a, m, n, A);
+  bool okB = sym ? true : pcc_rowset_init(&b, p, n, B);
 
-  //AA and BB can be computed simply by multiplying vector A[i] by vector A[i] and store in AA[i] via FMA, after A and B have had mask applied
+  pcc_stats stats;
+  stats.N = N; stats.T = T; stats.Pval = Pval;
+  bool ok = pcc_stats_init(&stats, n) && okA && okB;
+  if (ok) ok = pcc_rowset_run(&a, sym ? &a : &b, n, P, p, sym, NULL, NULL, &stats);
 
-  DataType tmp;
-  
-  //SAB may best be done by a GEMM operation, though the symmetric portion of the computation can be reduced by 
-  //  eliminating the lower triangular redundancy.
-  
+  mkl_free(stats.lbeta);
+  pcc_rowset_free(&a);
+  if (!sym) pcc_rowset_free(&b);
 
-  DataType* SAB =   ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 );
-  __assume_aligned(SAB, 64);
-  //#pragma omp parallel for reduction (+:sum)
-  for(i=0; i<m; ++i){
-    //for(j=i; j<p; ++j){//upper triangular computations only. Assuming p>=m
-    //for(j=; j<p; ++j){//upper triangular computations only. Assuming p>=m
-    for(j=0; j<p; ++j){
-       //#pragma SIMD
-       for(k=0;k<n;++k){
-          SAB[i*n+j] += A[i*n+k]*B[j*n+k];
-       }
+  if (!ok) {
+    printf( "\n ERROR: Can't allocate memory for intermediate matrices. Aborting... \n\n");
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
+  }
+  return 0;
+};
+
+//pcc_matrix with reduced precision (PCC_PRECISION_BF16 or PCC_PRECISION_INT8) SAB products, for screening
+// runs where full precision is not needed for most pairs. Pairs with |r| >= rescore are recomputed in full
+// precision (rescore > 1 disables the rescoring). B == NULL correlates the rows of A with each other (p = m).
+//With error != NULL the max (error[0]) and rms (error[1]) absolute difference to the full precision result
+// are measured on up to 64 evenly spaced rows of A, which costs 64 * p full precision pairs.
+int pcc_matrix_mixed(int m, int n, int p, const DataType* A, const DataType* B, DataType* P,
+                     int precision, DataType rescore, DataType* error)
+{
+  bool sym = (B == NULL);
+  if (sym) p = m;
+
+  pcc_rowset a, b;
+  bool okA = pcc_rowset_init(&a, m, n, A);
+  bool okB = sym ? true : pcc_rowset_init(&b, p, n, B);
+  const pcc_rowset* rb = sym ? &a : &b;
+  bool ok = okA && okB;
+  if (ok && precision != PCC_PRECISION_FULL) {
+    ok = pcc_rowset_quantize(&a, n, precision) && (sym || pcc_rowset_quantize(&b, n, precision));
+  }
+  if (ok) ok = pcc_rowset_run(&a, rb, n, P, p, sym, NULL, NULL, NULL, rescore);
+
+  if (ok && error != NULL) {
+    //packed position of every original row of A
+    std::vector<int> packed(m);
+    for (int r=0; r<m; r++) packed[a.order[r]] = r;
+    int stride = max(1, m / 64);
+    double maxerr = 0.0, sumsq = 0.0;
+    size_t count = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(max:maxerr) reduction(+:sumsq,count)
+    for (int i=0; i<m; i+=stride) {
+      for (int jb=0; jb<p; jb++) {
+        double d = fabs(P[(size_t)i*p + rb->order[jb]] - pcc_pair_exact(&a, packed[i], rb, jb, n));
+        maxerr = max(maxerr, d);
+        sumsq += d*d;
+        count++;
+      }
     }
+    error[0] = (DataType)maxerr;
+    error[1] = (DataType)((count > 0) ? sqrt(sumsq / count) : 0.0);
   }
 
-  DataType* SA =   ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 );
-  __assume_aligned(SA, 64);
-  //#pragma omp parallel for reduction (+:sum)
-  for(i=0; i<m; ++i){
-    for(j=0; j<p; ++j){
-       //#pragma SIMD
-       for(k=0;k<n;++k){
-          //tmp=(A[i*n+k] & Bmask[j*n+k]);
-          unsigned long* A_bitstring = reinterpret_cast<unsigned long* >(&(A[i*n+k]));
-          unsigned long* B_bitstring = reinterpret_cast<unsigned long* >(&(Bmask[j*n+k]));
-          unsigned long C_bitstring = *A_bitstring & *B_bitstring;
-          SA[i*n+j] += reinterpret_cast<DataType >(C_bitstring);
-       }
+  pcc_rowset_free(&a);
+  if (!sym) pcc_rowset_free(&b);
+
+  if (!ok) {
+    printf( "\n ERROR: Can't allocate memory for intermediate matrices. Aborting... \n\n");
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
+  }
+  return 0;
+};
+
+//pcc_matrix, or pcc_matrix_sym when B == NULL, on the observations cols[0..ncols-1] of the n wide rows of
+// A and B (all n observations when cols is NULL). The rowsets read the selected observations in place.
+//Returns false if memory could not be allocated.
+static bool pcc_matrix_cols(int m, int n, int p, const DataType* A, const DataType* B,
+                            const int* cols, int ncols, DataType* P)
+{
+  bool sym = (B == NULL);
+  if (cols == NULL) ncols = n;
+  pcc_rowset a, b;
+  bool ok = pcc_rowset_init(&a, m, ncols, A, NULL, cols, n);
+  if (!sym) ok &= pcc_rowset_init(&b, p, ncols, B, NULL, cols, n);
+  const pcc_rowset* rb = sym ? &a : &b;
+
+  if (ok && a.nfull == m && rb->nfull == p) {
+    //no missing data: a single GEMM (or SYRK and mirror) of the standardized rows
+    if (sym) {
+      SYRK(CblasRowMajor, CblasUpper, CblasNoTrans,
+           m, ncols, (DataType)1.0, a.Z, ncols, (DataType)0.0, P, m);
+      #pragma omp parallel
+      {
+        pcc_mirror_upper(m, P, m);
+      }
+    } else {
+      GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+           m, p, ncols, (DataType)1.0, a.Z, ncols, rb->Z, ncols, (DataType)0.0, P, p);
     }
+  } else if (ok) {
+    ok = pcc_rowset_run(&a, rb, ncols, P, p, sym);
   }
 
-  DataType* SB =   ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 );
-  __assume_aligned(SB, 64);
-  //#pragma omp parallel for reduction (+:sum)
-  for(j=0; j<p; ++j){
-     for(i=0; i<m; ++i){
-       //#pragma SIMD
-       for(k=0;k<n;++k){
-          //tmp=(B[j*n+k] & Amask[i*n+k]);
-           unsigned long* A_bitstring = reinterpret_cast<unsigned long* >(&(Amask[i*n+k]));
-           unsigned long* B_bitstring = reinterpret_cast<unsigned long* >(&(B[j*n+k]));
-           unsigned long C_bitstring = *A_bitstring & *B_bitstring;
-          SB[j*n+k] += reinterpret_cast<DataType >(C_bitstring);
-       }
+  pcc_rowset_free(&a);
+  if (!sym) pcc_rowset_free(&b);
+  return ok;
+}
+
+//Group conditioned version of pcc_matrix: P[g] (m x p) = pcc_matrix on the observations of group g, for
+// groups g = 0..ngroups-1 with the observations obs[start[g]..start[g+1]-1]. Every group is packed
+// directly from A and B through its observation list, so the groups share the input matrices and the
+// work of all groups together is about that of one pcc_matrix over their observations.
+//Masks and row sums are built per group, not shared: a row can be complete within a group and the
+// rows are centered by the group mean.
+int pcc_matrix_groups(int m, int n, int p, const DataType* A, const DataType* B,
+                      int ngroups, const size_t* start, const int* obs, DataType* const* P)
+{
+  if (B == NULL) p = m;
+  bool ok = true;
+  for (int g=0; g<ngroups && ok; g++) {
+    ok = pcc_matrix_cols(m, n, p, A, B, &obs[start[g]], (int)(start[g+1] - start[g]), P[g]);
+  }
+  if (!ok) {
+    printf( "\n ERROR: Can't allocate memory for intermediate matrices. Aborting... \n\n");
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
+  }
+  return 0;
+};
+
+//Batched version of pcc_matrix for many small problems, e.g. one correlation per marker genotype group.
+//Small problems run one per thread with sequential BLAS calls, so threading overhead is paid once per
+// batch instead of once per GEMM. Every thread owns a workspace for the packed rows, the gathered
+// observations and the tile scratch, which is reused for all its problems and only grows when a problem
+// needs more. Problems are started from the most expensive one (longest processing time first), so the
+// workspace of a thread is normally allocated once. Problems with enough tiles to occupy all threads on
+// their own run one after the other with the threaded pcc_matrix.
+
+//Observations of a problem, gathered when a subset is selected
+static int pcc_problem_n(const pcc_problem* pr){
+  return (pr->obs != NULL) ? pr->nobs : pr->n;
+}
+
+static int pcc_problem_p(const pcc_problem* pr){
+  return (pr->B != NULL) ? pr->p : pr->m;
+}
+
+//Workspace bytes of pcc_batch_solve
+static size_t pcc_batch_bytes(const pcc_problem* pr){
+  int n = pcc_problem_n(pr);
+  int p = pcc_problem_p(pr);
+  int tile = (PCC_TILE_P < PCC_TILE_M) ? PCC_TILE_P : PCC_TILE_M;
+  size_t bytes = pcc_rowset_bytes(pr->m, n) + pcc_tile_scratch_bytes(n);
+  bytes += 2*pcc_round64((size_t)(pr->m/tile + 2)*sizeof(int)) + 2*pcc_round64((size_t)(p/tile + 2)*sizeof(int));
+  if (pr->B != NULL) bytes += pcc_rowset_bytes(p, n);
+  return bytes;
+}
+
+//Solve one problem on the calling thread, all buffers are carved from the workspace mem
+static void pcc_batch_solve(const pcc_problem* pr, char* mem)
+{
+  bool sym = (pr->B == NULL);
+  int m = pr->m;
+  int n = pcc_problem_n(pr);
+  int p = pcc_problem_p(pr);
+
+  //a subset of the observations is read in place by the rowsets
+  pcc_rowset a, b;
+  pcc_rowset_init(&a, m, n, pr->A, &mem, pr->obs, pr->n);
+  if (!sym) pcc_rowset_init(&b, p, n, pr->B, &mem, pr->obs, pr->n);
+  const pcc_rowset* rb = sym ? &a : &b;
+
+  if (a.nfull == m && rb->nfull == p) {
+    //no missing data: a single GEMM (or SYRK) of the standardized rows
+    if (sym) {
+      SYRK(CblasRowMajor, CblasUpper, CblasNoTrans,
+           m, n, (DataType)1.0, a.Z, n, (DataType)0.0, pr->P, m);
+      for (int i=0; i<m; i++) {
+        for (int j=0; j<i; j++) pr->P[(size_t)i*m + j] = pr->P[(size_t)j*m + i];
+      }
+    } else {
+      GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+           m, p, n, (DataType)1.0, a.Z, n, rb->Z, n, (DataType)0.0, pr->P, p);
     }
+    return;
   }
 
-  DataType* SAA =   ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 );
-  __assume_aligned(SAA, 64);
-  //#pragma omp parallel for reduction (+:sum)
-  for(i=0; i<m; ++i){
-    for(j=0; j<p; ++j){
-       //#pragma SIMD
-       for(k=0;k<n;++k){
-          //tmp=(A[i*n+k] & Bmask[j*n+k]);
-          unsigned long* A_bitstring = reinterpret_cast<unsigned long* >(&(Amask[i*n+k]));
-          unsigned long* B_bitstring = reinterpret_cast<unsigned long* >(&(B[j*n+k]));
-          unsigned long C_bitstring = *A_bitstring & *B_bitstring;
-          tmp=reinterpret_cast<DataType >(C_bitstring);
-          SAA[i*n+j] += tmp*tmp;
-       }
+  pcc_tile_scratch s;
+  pcc_tile_scratch_alloc(&s, n, &mem);
+  int tileM = PCC_TILE_M;
+  int tileP = sym ? PCC_TILE_M : PCC_TILE_P;
+  int* startsA = (int*)pcc_carve(&mem, (size_t)(m/tileM + 2)*sizeof(int));
+  int* sizesA  = (int*)pcc_carve(&mem, (size_t)(m/tileM + 2)*sizeof(int));
+  int* startsB = (int*)pcc_carve(&mem, (size_t)(p/tileP + 2)*sizeof(int));
+  int* sizesB  = (int*)pcc_carve(&mem, (size_t)(p/tileP + 2)*sizeof(int));
+  int mtiles = pcc_rowset_tiles(&a, tileM, startsA, sizesA);
+  int ptiles = pcc_rowset_tiles(rb, tileP, startsB, sizesB);
+  for (int ib=0; ib<mtiles; ib++) {
+    for (int jb=(sym ? ib : 0); jb<ptiles; jb++) {
+      pcc_rowset_tile(&a, startsA[ib], sizesA[ib], rb, startsB[jb], sizesB[jb], n,
+                      pr->P, p, sym, &s, NULL, NULL, NULL, PCC_NO_RESCORE);
     }
   }
+}
 
-  DataType* SBB =   ( DataType*)mkl_calloc( m*p, sizeof(DataType), 64 );
-  __assume_aligned(SBB, 64);
-  //#pragma omp parallel for reduction (+:sum)
-  for(j=0; j<p; ++j){
-     for(i=0; i<m; ++i){
-       //#pragma SIMD
-       for(k=0;k<n;++k){
-          //tmp=(B[j*n+k] & Amask[i*n+k]);
-          unsigned long* A_bitstring = reinterpret_cast<unsigned long* >(&(Amask[i*n+k]));
-          unsigned long* B_bitstring = reinterpret_cast<unsigned long* >(&(B[j*n+k]));
-          unsigned long C_bitstring = *A_bitstring & *B_bitstring;
-          SBB[j*n+i] += reinterpret_cast<DataType >(C_bitstring);;
-       }
+int pcc_matrix_batch(int count, const pcc_problem* problems)
+{
+  #ifdef _OPENMP
+  int threads = omp_get_max_threads();
+  #else
+  int threads = 1;
+  #endif
+
+  //most expensive problems first, problems which fill all threads with tiles on their own are large
+  vector<int> order(count);
+  vector<double> cost(count);
+  for (int e=0; e<count; e++) {
+    const pcc_problem* pr = &problems[e];
+    order[e] = e;
+    cost[e] = (double)pr->m * pcc_problem_p(pr) * pcc_problem_n(pr);
+  }
+  std::sort(order.begin(), order.end(), [&](int x, int y) { return cost[x] > cost[y]; });
+  double large = (double)PCC_TILE_M * PCC_TILE_P * threads;
+  int nlarge = 0;
+  while (nlarge < count && threads > 1 &&
+         (double)problems[order[nlarge]].m * pcc_problem_p(&problems[order[nlarge]]) >= large) nlarge++;
+
+  bool ok = true;
+  for (int e=0; e<nlarge && ok; e++) {
+    const pcc_problem* pr = &problems[order[e]];
+    ok = pcc_matrix_cols(pr->m, pr->n, pcc_problem_p(pr), pr->A, pr->B, pr->obs, pcc_problem_n(pr), pr->P);
+  }
+
+  if (ok) {
+    #pragma omp parallel
+    {
+      char* ws = NULL;
+      size_t wsize = 0;
+      #pragma omp for schedule(dynamic, 1)
+      for (int e=nlarge; e<count; e++) {
+        const pcc_problem* pr = &problems[order[e]];
+        size_t need = pcc_batch_bytes(pr);
+        if (need > wsize) {
+          mkl_free(ws);
+          ws = (char*)mkl_malloc( need, 64 );
+          wsize = (ws != NULL) ? need : 0;
+        }
+        if (ws == NULL) {
+          #pragma omp atomic write
+          ok = false;
+          continue;
+        }
+        pcc_batch_solve(pr, ws);
+      }
+      mkl_free(ws);
     }
   }
 
+  if (!ok) {
+    printf( "\n ERROR: Can't allocate memory for the batch workspaces. Aborting... \n\n");
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
+  }
+  return 0;
+};
 
-  //allocate and initialize and align memory needed to compute PCC
+#endif
 
+#ifndef NOBLAS
 
+//Register block of the vector algorithm: PCC_VEC_RI rows of A x PCC_VEC_RJ rows of B
+// are accumulated in registers (6 terms x RI x RJ values, 24 AVX-512 registers in double)
+#ifndef PCC_VEC_RI
+  #define PCC_VEC_RI 2
+#endif
+#ifndef PCC_VEC_RJ
+  #define PCC_VEC_RJ 16
+#endif
 
-    //variables used for performance timing
-    struct timespec startGEMM, stopGEMM;
-    double accumGEMM;
+//Prepare the rows x n matrix X for the vector algorithm: X0 holds X with missing values
+// replaced by 0.0, XX the squares and U the 0/1 mask. With transpose set the outputs are stored
+// k-major (n x ld, row j in column j) so that consecutive rows of B are contiguous for the kernel.
+//Padding rows/columns beyond rows are left zero (mask 0) by the caller's calloc.
+//As in pcc_rowset_init the rows are shifted by the mean of their observed values.
+static void pcc_vector_prepare(int rows, int n, const DataType* X,
+                               DataType* X0, DataType* XX, DataType* U, bool transpose, int ld)
+{
+  int i,k;
+  #pragma omp parallel for private (i,k)
+  for (i=0; i<rows; i++) {
+    double shift = 0.0, c = 0.0;
+    for (k=0; k<n; k++) {
+      if (!CHECKNA(X[(size_t)i*n + k])) { shift += X[(size_t)i*n + k]; c += 1.0; }
+    }
+    DataType mean = (c > 0.0) ? (DataType)(shift / c) : (DataType)0.0;
+    for (k=0; k<n; k++) {
+      size_t idx = transpose ? (size_t)k*ld + i : (size_t)i*n + k;
+      DataType x = X[(size_t)i*n + k];
+      if (CHECKNA(x)) {
+        X0[idx] = 0.0;
+        U[idx] = 0.0;
+      }else{
+        X0[idx] = x - mean;
+        U[idx] = 1.0;
+      }
+      XX[idx] = X0[idx] * X0[idx];
+    }
+  }
+}
 
-    //info("before PCC terms\n",1);
+//Register blocked kernel of the vector algorithm, accumulates SA, SB, SAA, SBB, SAB and N for
+// PCC_VEC_RI rows of A (row major, stride n) against PCC_VEC_RJ rows of B (k-major, stride ldb)
+// in one pass over k, then assembles the ri x rj valid values into P.
+//The masks turn every term into a plain FMA: missing values are 0.0 in A0/B0, so
+// SAB += a*b, SA += a*ub, SAA += aa*ub, SB += ua*b, SBB += ua*bb, N += ua*ub
+static inline void pcc_vector_kernel(int n, int ri, int rj,
+                                     const DataType* A0, const DataType* AA, const DataType* UA,
+                                     const DataType* B0, const DataType* BB, const DataType* UB, int ldb,
+                                     DataType* P, int p)
+{
+  DataType sa[PCC_VEC_RI][PCC_VEC_RJ], sb[PCC_VEC_RI][PCC_VEC_RJ], saa[PCC_VEC_RI][PCC_VEC_RJ];
+  DataType sbb[PCC_VEC_RI][PCC_VEC_RJ], sab[PCC_VEC_RI][PCC_VEC_RJ], nn[PCC_VEC_RI][PCC_VEC_RJ];
+  for (int r=0; r<PCC_VEC_RI; r++) {
+    for (int j=0; j<PCC_VEC_RJ; j++) {
+      sa[r][j] = sb[r][j] = saa[r][j] = sbb[r][j] = sab[r][j] = nn[r][j] = 0.0;
+    }
+  }
 
-    //Compute PCC terms and assemble
+  for (int k=0; k<n; k++) {
+    const DataType* b  = &B0[(size_t)k*ldb];
+    const DataType* bb = &BB[(size_t)k*ldb];
+    const DataType* ub = &UB[(size_t)k*ldb];
+    for (int r=0; r<PCC_VEC_RI; r++) {
+      DataType a  = A0[r*n + k];
+      DataType aa = AA[r*n + k];
+      DataType ua = UA[r*n + k];
+      #pragma omp simd
+      for (int j=0; j<PCC_VEC_RJ; j++) {
+        sab[r][j] += a  * b[j];
+        sa[r][j]  += a  * ub[j];
+        saa[r][j] += aa * ub[j];
+        sb[r][j]  += ua * b[j];
+        sbb[r][j] += ua * bb[j];
+        nn[r][j]  += ua * ub[j];
+      }
+    }
+  }
 
-    CBLAS_TRANSPOSE transB=CblasNoTrans;
-    int ldb=p;
-    if(transposeB){
-      transB=CblasTrans;
-      ldb=n;
+  for (int r=0; r<ri; r++) {
+    for (int j=0; j<rj; j++) {
+      P[(size_t)r*p + j] = pcc_value(nn[r][j], sa[r][j], sb[r][j], saa[r][j], sbb[r][j], sab[r][j]);
     }
+  }
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &startGEMM);
-    mkl_free(UnitA);
-    mkl_free(UnitB);
+//This function uses masking to accumulate all PCC terms in a single pass over k, instead of
+// running six GEMMs and writing the six m x p term matrices to memory.
+//The intention is to improve upon the matrix x matrix missing data PCC algorithm by reducing the memory
+// traffic, which pays off at high missingness rates where the matrix algorithm cannot skip any terms.
+//A is matrix of X vectors and B is transposed matrix of Y vectors:
+//P = (N*SAB - SA*SB)/Sqrt( (N*SAA - (SA)^2) * (N*SBB - (SB)^2)  )
+//Where element pairs with a missing value are masked out of every term. The output is walked in
+// PCC_TILE_M x PCC_TILE_P cache tiles (distributed over the threads) of PCC_VEC_RI x PCC_VEC_RJ register blocks.
+int pcc_vector(int m, int n, int p,
+               const DataType* A, const DataType* B, DataType* P)
+{
+  //pad A by RI rows and B by RJ rows so the last register block of a tile never reads past
+  // the matrices, the padding is masked out
+  int mpad = m + PCC_VEC_RI;
+  int ppad = p + PCC_VEC_RJ;
+
+  DataType* A0 = (DataType*)mkl_calloc( (size_t)mpad*n, sizeof(DataType), 64 );
+  DataType* AA = (DataType*)mkl_calloc( (size_t)mpad*n, sizeof(DataType), 64 );
+  DataType* UA = (DataType*)mkl_calloc( (size_t)mpad*n, sizeof(DataType), 64 );
+  DataType* B0 = (DataType*)mkl_calloc( (size_t)n*ppad, sizeof(DataType), 64 );
+  DataType* BB = (DataType*)mkl_calloc( (size_t)n*ppad, sizeof(DataType), 64 );
+  DataType* UB = (DataType*)mkl_calloc( (size_t)n*ppad, sizeof(DataType), 64 );
 
-    clock_gettime(CLOCK_MONOTONIC, &stopGEMM);
-    accumGEMM =  (TimeSpecToSeconds(&stopGEMM)- TimeSpecToSeconds(&startGEMM));
-    //printf("All(5) GEMMs (%e)s GFLOPs=%e \n", accumGEMM, 5*(2/1.0e9)*m*n*p/accumGEMM);
+  //if any of the above allocations failed, then we have run out of RAM on the node and we need to abort
+  if ( (A0 == NULL) | (AA == NULL) | (UA == NULL) | (B0 == NULL) | (BB == NULL) | (UB == NULL) ) {
+    printf( "\n ERROR: Can't allocate memory for intermediate matrices. Aborting... \n\n");
+    mkl_free(A0); mkl_free(AA); mkl_free(UA);
+    mkl_free(B0); mkl_free(BB); mkl_free(UB);
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
+  }
 
-    DataType* SASB = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 );
-    DataType* NSAB = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); //ceb
-   
-    DataType* SASA = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); 
-    DataType* NSAA = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); //ceb
-    
-    DataType* SBSB = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 );    
-    DataType* NSBB = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); //ceb   
-    
-    DataType* DENOM = ( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 );
-    DataType* DENOMSqrt =( DataType*)mkl_calloc( m*p,sizeof(DataType), 64 ); 
-
-    //Compute and assemble composite terms
-
-    //SASB=SA*SB
-    VMUL(m*p,SA,SB,SASB);
-    //N*SAB
-    VMUL(m*p,N,SAB,NSAB); //ceb
-    //SAB=(-1)SASB+NSAB  (numerator)
-    AXPY(m*p,(DataType)(-1), SASB,1, NSAB,1); //ceb
-
-    //(SA)^2
-    //vsSqr(m*p,SA,SASA);
-    VSQR(m*p,SA,SASA);
-    //N(SAA)
-    VMUL(m*p,N,SAA,NSAA); //ceb
-    //SAA=NSAA-SASA (denominator term 1)
-    AXPY(m*p,(DataType)(-1), SASA,1, NSAA,1);
-
-    //(SB)^2
-    //vsSqr(m*p,SB,SBSB);
-    VSQR(m*p,SB,SBSB);
-    //N(SBB)
-    VMUL(m*p,N,SBB,NSBB);
-    //SBB=NSBB-SBSB
-    AXPY(m*p,(DataType)(-1), SBSB,1, NSBB,1);
-
-    //DENOM=NSAA*NSBB (element wise multiplication)
-    VMUL(m*p,NSAA,NSBB,DENOM);
-    for(int i=0;i<m*p;++i){
-       if(DENOM[i]==0.){DENOM[i]=1;}//numerator will be 0 so to prevent inf, set denom to 1
-    }
-    //sqrt(DENOM)
-    VSQRT(m*p,DENOM,DENOMSqrt);
-    //P=SAB/DENOMSqrt (element wise division)
-    VDIV(m*p,SAB,DENOMSqrt,P);   
-
-    mkl_free(SASA);
-    mkl_free(SASB);
-    mkl_free(SBSB);
-    mkl_free(NSAB);
-    mkl_free(NSAA);
-    mkl_free(NSBB);
-    mkl_free(DENOM);
-    mkl_free(DENOMSqrt); 
-  }
-
-  mkl_free(N);
-  mkl_free(SA);
-  mkl_free(SAA);
-  mkl_free(SB);
-  mkl_free(SBB);
-  mkl_free(SAB);
+  pcc_vector_prepare(m, n, A, A0, AA, UA, false, n);
+  pcc_vector_prepare(p, n, B, B0, BB, UB, true, ppad);
+
+  int mtiles = (m + PCC_TILE_M - 1) / PCC_TILE_M;
+  int ptiles = (p + PCC_TILE_P - 1) / PCC_TILE_P;
+
+  #pragma omp parallel for collapse(2) schedule(dynamic)
+  for (int ib=0; ib<mtiles; ib++) {
+    for (int jb=0; jb<ptiles; jb++) {
+      int iend = (m - ib*PCC_TILE_M < PCC_TILE_M) ? m : (ib+1)*PCC_TILE_M;
+      int jend = (p - jb*PCC_TILE_P < PCC_TILE_P) ? p : (jb+1)*PCC_TILE_P;
+      for (int i=ib*PCC_TILE_M; i<iend; i+=PCC_VEC_RI) {
+        int ri = (iend - i < PCC_VEC_RI) ? iend - i : PCC_VEC_RI;
+        for (int j=jb*PCC_TILE_P; j<jend; j+=PCC_VEC_RJ) {
+          int rj = (jend - j < PCC_VEC_RJ) ? jend - j : PCC_VEC_RJ;
+          pcc_vector_kernel(n, ri, rj, &A0[(size_t)i*n], &AA[(size_t)i*n], &UA[(size_t)i*n],
+                            &B0[j], &BB[j], &UB[j], ppad, &P[(size_t)i*p + j], p);
+        }
+      }
+    }
+  }
+
+  mkl_free(A0); mkl_free(AA); mkl_free(UA);
+  mkl_free(B0); mkl_free(BB); mkl_free(UB);
 
   return 0;
 };
 
-#endif
 #endif
 
-#ifndef USING_R
+//PCC_NO_MAIN builds the library functions only, for the test drivers in tests/ (make check)
+#if !defined(USING_R) && !defined(PCC_NO_MAIN)
 
 int main (int argc, char **argv) {
   //ceb testing with various square matrix sizes
@@ -769,19 +1996,81 @@ int main (int argc, char **argv) {
   //32768 = 2048*16
   //40960 = 2560*16 too large (for skylake)
 
+  #ifdef MPCC_MPI
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  #endif
+
   //set default values 
   int m=64;//16*1500;//24000^3 for peak performance on skylake
   int n=16;
   int p=32;
   int count=1;
   int seed =1; 
-  char* matA_filename;//="matA.dat";
-  char* matB_filename;//="matB.dat";
+  char* matA_filename=NULL;//="matA.dat";
+  char* matB_filename=NULL;//="matB.dat";
+  char* matP_filename=NULL;
+
+  //options of the text loader: --delim=<c>, --header=<lines>, --labels=<columns>, --na=<NA,nan,...>
+  pcc_text_options text;
+  pcc_text_defaults(&text);
+  //--spearman computes the Spearman rank correlation (exact pairwise ranks), --spearman=approx ranks every row once
+  int spearman=0;
+  //--precision=bf16|int8 computes the SAB products in reduced precision, --rescore=<r> recomputes pairs with |r| >= r
+  int precision=PCC_PRECISION_FULL;
+  DataType rescore=PCC_NO_RESCORE;
+#ifdef MPCC_MPI
+  int block=PCC_TILE_M;
+#endif
+  int nargs=1;
+  for(int i=1;i<argc;i++){
+    if(strncmp(argv[i],"--delim=",8)==0){ text.delim = (strcmp(argv[i]+8,"\\t")==0) ? '\t' : argv[i][8]; }
+    else if(strncmp(argv[i],"--header=",9)==0){ text.header = atoi(argv[i]+9); }
+    else if(strncmp(argv[i],"--labels=",9)==0){ text.labels = atoi(argv[i]+9); }
+    else if(strncmp(argv[i],"--na=",5)==0){ text.na_tokens = argv[i]+5; }
+    else if(strcmp(argv[i],"--spearman")==0){ spearman = 1; }
+    else if(strcmp(argv[i],"--spearman=approx")==0){ spearman = 2; }
+    else if(strcmp(argv[i],"--precision=bf16")==0){ precision = PCC_PRECISION_BF16; }
+    else if(strcmp(argv[i],"--precision=int8")==0){ precision = PCC_PRECISION_INT8; }
+    else if(strncmp(argv[i],"--rescore=",10)==0){ rescore = atof(argv[i]+10); }
+#ifdef MPCC_MPI
+    else if(strncmp(argv[i],"--block=",8)==0){ block = atoi(argv[i]+8); }
+#endif
+    else if(strncmp(argv[i],"--size=",7)==0){ sscanf(argv[i]+7, "%d,%d,%d", &m, &n, &p); }
+    else{ argv[nargs++] = argv[i]; }
+  }
+  argc = nargs;
  
   if(argc>1){ matA_filename = argv[1]; }
   if(argc>2){ matB_filename = argv[2]; }
+  if(argc>3){ matP_filename = argv[3]; }
   
   struct timespec startPCC,stopPCC;
+
+#ifdef MPCC_MPI
+  //distributed mode when started on more than one rank, or with a result file on one rank
+  int ranks;
+  MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+  if(ranks>1 || argc==4){
+    pcc_mpi(matA_filename, matB_filename, matP_filename, block);
+    MPI_Finalize();
+    return 0;
+  }
+#endif
+
+  //out-of-core mode when a memory budget is given: ./MPCC MatA_filename MatB_filename MatP_filename budget_MB
+  if(argc>4){
+    size_t budget = (size_t)(atof(argv[4]) * 1024 * 1024);
+    clock_gettime(CLOCK_MONOTONIC, &startPCC);
+    printf("streaming matrix PCC implmentation\n");
+    pcc_stream(matA_filename, matB_filename, matP_filename, budget);
+    clock_gettime(CLOCK_MONOTONIC, &stopPCC);
+    printf("completed in %e seconds\n", (TimeSpecToSeconds(&stopPCC)- TimeSpecToSeconds(&startPCC)));
+    #ifdef MPCC_MPI
+    MPI_Finalize();
+    #endif
+    return 0;
+  }
   // A is n x p (tall and skinny) row major order
   // B is p x m (short and fat) row major order
   // R is n x m (big and square) row major order
@@ -793,17 +2082,30 @@ int main (int argc, char **argv) {
   DataType accumR;
    
   bool transposeB=false;
-  initialize(m, n, p, seed, &A, &B, &R, matA_filename, matB_filename, transposeB);
+  pcc_matrix_file fileA, fileB;
+  initialize(m, n, p, seed, &A, &B, &R, matA_filename, matB_filename, transposeB, &fileA, &fileB, &text);
   //C = (DataType *)mkl_calloc( m*p,sizeof( DataType ), 64 );
   clock_gettime(CLOCK_MONOTONIC, &startPCC);
+  if(spearman){
+    printf("%s spearman implmentation\n", (spearman==1) ? "exact" : "approximate");
+    pcc_spearman(m, n, p, A, B, R, spearman==1);
+  }else if(precision != PCC_PRECISION_FULL){
+    DataType error[2];
+    printf("%s mixed precision matrix PCC implmentation\n", (precision == PCC_PRECISION_BF16) ? "bf16" : "int8");
+    pcc_matrix_mixed(m, n, p, A, B, R, precision, rescore, error);
+    printf("error against full precision: max %e rms %e\n", error[0], error[1]);
+  }else{
 #if NAIVE
   printf("naive PCC implmentation\n");
   pcc_naive(m, n, p, A, B, R);
+#elif VECTOR
+  printf("vector PCC implmentation\n");
+  pcc_vector(m, n, p, A, B, R);
 #else  
   printf("matrix PCC implmentation\n");
   pcc_matrix(m, n, p, A, B, R);
-  //pcc_vector(m, n, p, A, B, R);
 #endif
+  }
   clock_gettime(CLOCK_MONOTONIC, &stopPCC);
   accumR =  (TimeSpecToSeconds(&stopPCC)- TimeSpecToSeconds(&startPCC));
 
@@ -875,6 +2177,16 @@ int main (int argc, char **argv) {
 
   printf("completed in %e seconds, size: m=%d n=%d p=%d GFLOPs=%e \n",accumR, m,n,p, (5*2/1.0e9)*m*n*p/accumR);
 
+  //write the result matrix, with the variable names of A and B as row and column names
+  if(matP_filename != NULL && !pcc_file_write(matP_filename, m, p, R, fileA.rownames, transposeB ? fileB.colnames : fileB.rownames)){
+    printf("Can't write result matrix to %s\n", matP_filename);
+  }
+  pcc_file_close(&fileA);
+  pcc_file_close(&fileB);
+
+  #ifdef MPCC_MPI
+  MPI_Finalize();
+  #endif
   return 0;
 }
 
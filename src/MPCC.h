@@ -8,11 +8,48 @@
 
     #define BILLION  1000000000L
 
+    #include <stdint.h>
+    #if defined(__AVX2__) || defined(__AVX512F__)
+      #include <immintrin.h>
+    #endif
+
     #ifdef MKL // Disable the mkl as needed
       #include <mkl.h>
     #else
       #define NOMKL 1
       #include <math.h>
+      #include <stdlib.h>
+      #include <string.h>
+      #ifndef NOBLAS // Portable CBLAS (OpenBLAS, BLIS, reference CBLAS) instead of MKL
+        #include <cblas.h>
+      #endif
+
+      // Portable replacements for the MKL aligned allocation functions
+      static inline void* pcc_aligned_malloc(size_t size, int alignment) {
+        void* ptr = NULL;
+        if (size == 0) size = alignment;
+        #ifdef _WIN32
+        ptr = _aligned_malloc(size, alignment);
+        #else
+        if (posix_memalign(&ptr, alignment, size) != 0) ptr = NULL;
+        #endif
+        return ptr;
+      }
+      static inline void* pcc_aligned_calloc(size_t num, size_t size, int alignment) {
+        void* ptr = pcc_aligned_malloc(num * size, alignment);
+        if (ptr != NULL) memset(ptr, 0, num * size);
+        return ptr;
+      }
+      static inline void pcc_aligned_free(void* ptr) {
+        #ifdef _WIN32
+        _aligned_free(ptr);
+        #else
+        free(ptr);
+        #endif
+      }
+      #define mkl_malloc(size, alignment) pcc_aligned_malloc(size, alignment)
+      #define mkl_calloc(num, size, alignment) pcc_aligned_calloc(num, size, alignment)
+      #define mkl_free(ptr) pcc_aligned_free(ptr)
     #endif
 
     #ifdef STANDALONE // Completely standalone (TODO: Implement LIB)
@@ -55,22 +92,52 @@
 
   #if DOUBLE
     #define DataType double
-    #define VSQR vdSqr
-    #define VMUL vdMul
-    #define VSQRT vdSqrt
-    #define VDIV vdDiv
+    #ifndef NOMKL
+      #define VSQR vdSqr
+      #define VMUL vdMul
+      #define VSQRT vdSqrt
+      #define VDIV vdDiv
+    #endif
     #define GEMM cblas_dgemm
+    #define SYRK cblas_dsyrk
     #define AXPY cblas_daxpy
   #else
     #define DataType float
-    #define VSQR vsSqr
-    #define VMUL vsMul
-    #define VSQRT vsSqrt
-    #define VDIV  vsDiv
+    #ifndef NOMKL
+      #define VSQR vsSqr
+      #define VMUL vsMul
+      #define VSQRT vsSqrt
+      #define VDIV  vsDiv
+    #endif
     #define GEMM cblas_sgemm
+    #define SYRK cblas_ssyrk
     #define AXPY cblas_saxpy
   #endif
 
+  #ifdef NOMKL
+    // Portable replacements for the MKL vector math (VML) functions
+    static inline void pcc_vsqr(int n, const DataType* a, DataType* y) {
+      #pragma omp simd
+      for (int i=0; i<n; i++) y[i] = a[i] * a[i];
+    }
+    static inline void pcc_vmul(int n, const DataType* a, const DataType* b, DataType* y) {
+      #pragma omp simd
+      for (int i=0; i<n; i++) y[i] = a[i] * b[i];
+    }
+    static inline void pcc_vsqrt(int n, const DataType* a, DataType* y) {
+      #pragma omp simd
+      for (int i=0; i<n; i++) y[i] = sqrt(a[i]);
+    }
+    static inline void pcc_vdiv(int n, const DataType* a, const DataType* b, DataType* y) {
+      #pragma omp simd
+      for (int i=0; i<n; i++) y[i] = a[i] / b[i];
+    }
+    #define VSQR pcc_vsqr
+    #define VMUL pcc_vmul
+    #define VSQRT pcc_vsqrt
+    #define VDIV pcc_vdiv
+  #endif
+
 #ifdef __MINGW32__
     #define NANF nan("1")
 #else
@@ -80,9 +147,83 @@
 #define MISSING_MARKER NANF
 
     // Forward declaration of the functions
-    int pcc_matrix(int m, int n, int p, DataType* A, DataType* B, DataType* P);
-    int pcc_vector(int m, int n, int p, DataType* A, DataType* B, DataType* P);
-    int pcc_naive(int m, int n, int p, DataType* A, DataType* B, DataType* P);
+    // The input matrices A (m x n) and B (p x n) are read only, missing values are handled in scratch memory
+    // Workspace of pcc_matrix and pcc_matrix_sym which is reused across calls, start with { NULL, 0 }
+    struct pcc_workspace {
+      char* mem;
+      size_t bytes;
+    };
+    // Workspace bytes of pcc_matrix (p = 0 for pcc_matrix_sym) with the current number of OpenMP threads
+    size_t pcc_workspace_bytes(int m, int n, int p);
+    // Grow the workspace to at least bytes (not zero filled), returns false if it could not be allocated
+    bool pcc_workspace_reserve(pcc_workspace* ws, size_t bytes);
+    void pcc_workspace_free(pcc_workspace* ws);
+    int pcc_matrix(int m, int n, int p, const DataType* A, const DataType* B, DataType* P, pcc_workspace* ws = NULL);
+    int pcc_matrix_sym(int m, int n, const DataType* A, DataType* P, pcc_workspace* ws = NULL);
+    // BLAS style pcc_matrix on strided (sub) matrices: op(A) (m x n) and op(B) (p x n) hold the variables in their
+    // rows, op(X) = X or X' (trans), stored in layout with leading dimensions lda, ldb. P (m x p) is stored in
+    // layout with leading dimension ldp, B == NULL correlates A with itself (p = m). As in BLAS the leading
+    // dimensions are int, offsets are computed in 64 bit
+    #define PCC_ROW_MAJOR 0
+    #define PCC_COL_MAJOR 1
+    #define PCC_NO_TRANS 0
+    #define PCC_TRANS 1
+    int pcc_matrix_strided(int layout, int transA, int transB, int m, int n, int p,
+                           const DataType* A, int lda, const DataType* B, int ldb, DataType* P, int ldp,
+                           pcc_workspace* ws = NULL);
+    // Sparse (COO) result of pcc_matrix, pairs with |r| >= threshold and/or the top k pairs per row of A
+    struct pcc_sparse {
+      size_t nnz;
+      int* i;
+      int* j;
+      DataType* r;
+      DataType* n;
+    };
+    // Precision of the SAB products of the matrix algorithm, the reduced precisions are meant for screening
+    #define PCC_PRECISION_FULL 0
+    #define PCC_PRECISION_BF16 1
+    #define PCC_PRECISION_INT8 2
+    #define PCC_NO_RESCORE 2.0
+    int pcc_matrix_sparse(int m, int n, int p, const DataType* A, const DataType* B,
+                          DataType threshold, int k, pcc_sparse* S,
+                          int precision = PCC_PRECISION_FULL, DataType rescore = PCC_NO_RESCORE);
+    void pcc_sparse_free(pcc_sparse* S);
+    // pcc_matrix with the significance of every pair: the m x p matrices of pairwise complete observations N,
+    // t statistics T and two sided p-values Pval (each may be NULL), B == NULL correlates A with itself
+    int pcc_matrix_stats(int m, int n, int p, const DataType* A, const DataType* B, DataType* P,
+                         DataType* N, DataType* T, DataType* Pval);
+    // pcc_matrix with reduced precision SAB products, pairs with |r| >= rescore are recomputed in full precision and
+    // with error != NULL the max and rms absolute error against full precision are estimated (error[0], error[1])
+    int pcc_matrix_mixed(int m, int n, int p, const DataType* A, const DataType* B, DataType* P,
+                         int precision, DataType rescore, DataType* error);
+    // One problem of a batch: P (m x p) = pcc_matrix(A, B), or with B == NULL P (m x m) = pcc_matrix_sym(A). The rows
+    // of A and B have n observations, with obs != NULL only the nobs observations obs[0..nobs-1] take part
+    struct pcc_problem {
+      int m, n, p;
+      const DataType* A;
+      const DataType* B;
+      DataType* P;
+      const int* obs;
+      int nobs;
+    };
+    // Solve count independent problems, small problems run one per thread and reuse per-thread workspaces
+    int pcc_matrix_batch(int count, const pcc_problem* problems);
+    // Group conditioned PCC: the m x p matrix P[g] = pcc_matrix on the observations obs[start[g]..start[g+1]-1]
+    // of group g, for every group g < ngroups, with B == NULL the rows of A are correlated with each other (p = m)
+    int pcc_matrix_groups(int m, int n, int p, const DataType* A, const DataType* B,
+                          int ngroups, const size_t* start, const int* obs, DataType* const* P);
+    // Spearman rank correlation, exact re-ranks the pairs with different missing values on their complete observations
+    int pcc_spearman(int m, int n, int p, const DataType* A, const DataType* B, DataType* P, bool exact);
+    int pcc_vector(int m, int n, int p, const DataType* A, const DataType* B, DataType* P);
+    int pcc_naive(int m, int n, int p, const DataType* A, const DataType* B, DataType* P);
+    #ifndef USING_R
+    // Out-of-core version of pcc_matrix, streams A, B and the result P from and to binary files
+    int pcc_stream(const char* matA_filename, const char* matB_filename, const char* matP_filename, size_t budget);
+    #ifdef MPCC_MPI
+    // Distributed memory version of pcc_matrix, all ranks of MPI_COMM_WORLD compute a 2D block-cyclic part of P
+    int pcc_mpi(const char* matA_filename, const char* matB_filename, const char* matP_filename, int block);
+    #endif
+    #endif
 
 #endif //__MPCC_H__
 
@@ -0,0 +1,176 @@
+//Binary matrix file format of the standalone executable, see MPCCio.h for the layout
+//Input matrices are memory mapped, when the element type matches DataType and missing values are
+// NaN the mapping is used directly by the algorithms (no parsing, no copies).
+
+#include "MPCCio.h"
+
+#ifndef USING_R
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static_assert(sizeof(pcc_file_header) == PCC_FILE_DATA_OFFSET, "pcc_file_header must be 64 bytes");
+
+//Read or write bytes at offset, pread and pwrite may transfer less than requested
+bool pcc_file_pread(int fd, void* buf, size_t bytes, off_t offset){
+  char* ptr = (char*)buf;
+  while (bytes > 0) {
+    ssize_t r = pread(fd, ptr, bytes, offset);
+    if (r <= 0) return false;
+    ptr += r; bytes -= r; offset += r;
+  }
+  return true;
+}
+
+bool pcc_file_pwrite(int fd, const void* buf, size_t bytes, off_t offset){
+  const char* ptr = (const char*)buf;
+  while (bytes > 0) {
+    ssize_t r = pwrite(fd, ptr, bytes, offset);
+    if (r <= 0) return false;
+    ptr += r; bytes -= r; offset += r;
+  }
+  return true;
+}
+
+//Split the names block into rows + cols strings, returns false if the block is malformed
+static bool pcc_file_names(pcc_matrix_file* f){
+  uint64_t count = f->h.rows + f->h.cols;
+  f->names = (char**)malloc( (count > 0 ? count : 1)*sizeof(char*) );
+  if (f->names == NULL) return false;
+  char* ptr = (char*)f->map + f->h.names_offset;
+  char* end = ptr + f->h.names_size;
+  for (uint64_t i=0; i<count; i++) {
+    char* eos = (char*)memchr(ptr, '\0', end - ptr);
+    if (eos == NULL) return false;
+    f->names[i] = ptr;
+    ptr = eos + 1;
+  }
+  f->rownames = f->names;
+  f->colnames = &f->names[f->h.rows];
+  return true;
+}
+
+void pcc_file_fix_missing(const pcc_file_header* h, DataType* X, size_t count){
+  if (h->missing != PCC_FILE_NA_VALUE) return;
+  DataType na = (DataType)h->na_value;
+  for (size_t i=0; i<count; i++) {
+    if (X[i] == na) X[i] = MISSING_MARKER;
+  }
+}
+
+void pcc_file_close(pcc_matrix_file* f){
+  if (f->copied) mkl_free(f->data);
+  if (f->map != NULL) munmap(f->map, f->map_size);
+  if (f->fd >= 0) close(f->fd);
+  free(f->names);
+  free(f->namebuf);
+  f->fd = -1; f->data = NULL; f->map = NULL; f->rownames = f->colnames = f->names = NULL; f->namebuf = NULL; f->copied = false;
+}
+
+bool pcc_file_open(const char* filename, pcc_matrix_file* f, bool load){
+  f->fd = -1; f->data = NULL; f->map = NULL; f->map_size = 0;
+  f->rownames = f->colnames = f->names = NULL; f->namebuf = NULL; f->copied = false;
+  if (filename == NULL) return false;
+  f->fd = open(filename, O_RDONLY);
+  if (f->fd < 0) return false;
+
+  //validate the header against the file size, the sizes are compared by division and
+  // subtraction so that a corrupt header cannot overflow them
+  pcc_file_header* h = &f->h;
+  off_t size = lseek(f->fd, 0, SEEK_END);
+  if (size < PCC_FILE_DATA_OFFSET || !pcc_file_pread(f->fd, h, sizeof(pcc_file_header), 0) ||
+      strncmp(h->magic, PCC_FILE_MAGIC, sizeof(h->magic)) != 0 || h->version != PCC_FILE_VERSION ||
+      (h->dtype != sizeof(float) && h->dtype != sizeof(double)) || h->layout > PCC_FILE_COL_MAJOR ||
+      h->missing > PCC_FILE_NA_VALUE || h->rows > INT32_MAX || h->cols > INT32_MAX ||
+      (h->cols != 0 && h->rows > ((uint64_t)size - PCC_FILE_DATA_OFFSET) / h->cols / h->dtype) ||
+      (h->names_offset != 0 && (h->names_offset > (uint64_t)size || h->names_size > (uint64_t)size - h->names_offset))) {
+    pcc_file_close(f);
+    return false;
+  }
+  f->map_size = size;
+  f->map = mmap(NULL, f->map_size, PROT_READ, MAP_SHARED, f->fd, 0);
+  if (f->map == MAP_FAILED) {
+    f->map = NULL;
+    pcc_file_close(f);
+    return false;
+  }
+  if (h->names_offset != 0 && !pcc_file_names(f)) {
+    pcc_file_close(f);
+    return false;
+  }
+
+  //variables are the rows of a row major file and the columns of a column major file
+  f->rows = (int)h->rows;
+  f->cols = (int)h->cols;
+  if (h->layout == PCC_FILE_COL_MAJOR) {
+    std::swap(f->rows, f->cols);
+    std::swap(f->rownames, f->colnames);
+  }
+  if (!load) return true;
+
+  const char* elems = (const char*)f->map + PCC_FILE_DATA_OFFSET;
+  size_t count = (size_t)f->rows * f->cols;
+  if (h->dtype == sizeof(DataType) && h->missing == PCC_FILE_NA_NAN) {
+    f->data = (DataType*)elems;
+    madvise(f->map, f->map_size, MADV_WILLNEED);
+    return true;
+  }
+  //convert the element type and/or the missing value marker
+  f->data = (DataType*)mkl_malloc( (count > 0 ? count : 1)*sizeof(DataType), 64 );
+  if (f->data == NULL) {
+    pcc_file_close(f);
+    return false;
+  }
+  f->copied = true;
+  #pragma omp parallel for
+  for (size_t i=0; i<count; i++) {
+    f->data[i] = (h->dtype == sizeof(float)) ? (DataType)((const float*)elems)[i] : (DataType)((const double*)elems)[i];
+  }
+  pcc_file_fix_missing(h, f->data, count);
+  return true;
+}
+
+int pcc_file_create(const char* filename, int rows, int cols, char** rownames, char** colnames){
+  pcc_file_header h;
+  memset(&h, 0, sizeof(h));
+  strncpy(h.magic, PCC_FILE_MAGIC, sizeof(h.magic));
+  h.version = PCC_FILE_VERSION;
+  h.dtype = sizeof(DataType);
+  h.layout = PCC_FILE_ROW_MAJOR;
+  h.missing = PCC_FILE_NA_NAN;
+  h.rows = rows;
+  h.cols = cols;
+  if (rownames != NULL || colnames != NULL) { //a missing set of names is stored as empty strings
+    h.names_offset = PCC_FILE_DATA_OFFSET + (uint64_t)rows*cols*sizeof(DataType);
+    for (int i=0; i<rows; i++) h.names_size += (rownames != NULL ? strlen(rownames[i]) : 0) + 1;
+    for (int j=0; j<cols; j++) h.names_size += (colnames != NULL ? strlen(colnames[j]) : 0) + 1;
+  }
+
+  //the file is sized upfront, so that the elements can be written in any order
+  int fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) return -1;
+  bool ok = pcc_file_pwrite(fd, &h, sizeof(h), 0) &&
+            ftruncate(fd, (off_t)(PCC_FILE_DATA_OFFSET + (uint64_t)rows*cols*sizeof(DataType) + h.names_size)) == 0;
+  off_t offset = h.names_offset;
+  for (int i=0; ok && h.names_offset != 0 && i<rows+cols; i++) {
+    const char* name = (i < rows) ? (rownames != NULL ? rownames[i] : "") : (colnames != NULL ? colnames[i - rows] : "");
+    ok = pcc_file_pwrite(fd, name, strlen(name) + 1, offset);
+    offset += strlen(name) + 1;
+  }
+  if (!ok) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool pcc_file_write(const char* filename, int rows, int cols, const DataType* X, char** rownames, char** colnames){
+  int fd = pcc_file_create(filename, rows, cols, rownames, colnames);
+  if (fd < 0) return false;
+  bool ok = pcc_file_pwrite(fd, X, (size_t)rows*cols*sizeof(DataType), PCC_FILE_DATA_OFFSET);
+  if (close(fd) != 0) ok = false;
+  return ok;
+}
+
+#endif
@@ -0,0 +1,94 @@
+/******************************************************************//**
+ * \file MPCCio.h
+ * \brief Binary matrix file format of the standalone executable
+ *
+ * A matrix file is a 64 byte header, followed by the elements and optionally the names:
+ *
+ *   offset  type      field
+ *   0       char[8]   magic "MPCCMAT" (NUL terminated)
+ *   8       uint32    version (1)
+ *   12      uint32    dtype, size of an element: 4 (float) or 8 (double)
+ *   16      uint32    layout: 0 row major, 1 column major
+ *   20      uint32    missing: 0 missing values are NaN, 1 missing values equal na_value
+ *   24      uint64    rows
+ *   32      uint64    cols
+ *   40      uint64    names_offset, 0 when the file has no names
+ *   48      uint64    names_size in bytes
+ *   56      double    na_value (only used when missing is 1)
+ *   64      dtype[]   rows * cols elements
+ *   names_offset      rows + cols NUL terminated strings, the row names followed by the column names
+ *
+ * All values are stored in the byte order of the machine. The rows of a row major file and the
+ * columns of a column major file are the variables which are correlated, so a column major
+ * (observations x variables) matrix as stored by R can be used without transposing.
+ * Files whose dtype is DataType and that use NaN as missing value are mapped without copies.
+ **********************************************************************/
+#ifndef __MPCCIO_H__
+  #define __MPCCIO_H__
+
+  #include "MPCC.h"
+  #include <sys/types.h>
+
+  #define PCC_FILE_MAGIC "MPCCMAT"
+  #define PCC_FILE_VERSION 1
+  #define PCC_FILE_ROW_MAJOR 0
+  #define PCC_FILE_COL_MAJOR 1
+  #define PCC_FILE_NA_NAN 0
+  #define PCC_FILE_NA_VALUE 1
+  #define PCC_FILE_DATA_OFFSET 64
+
+  struct pcc_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t layout;
+    uint32_t missing;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t names_offset;
+    uint64_t names_size;
+    double na_value;
+  };
+
+  /** An opened matrix file, rows are the variables and cols the observations */
+  struct pcc_matrix_file {
+    int fd;
+    pcc_file_header h;
+    int rows;
+    int cols;
+    DataType* data;    // rows x cols row major, NULL when not loaded
+    char** rownames;   // names of the variables, NULL when the file has no names
+    char** colnames;   // names of the observations, NULL when the file has no names
+    char** names;      // all names, rownames and colnames point into it
+    char* namebuf;     // storage of the names read from a text file
+    void* map;         // read only mapping of the file
+    size_t map_size;
+    bool copied;       // data was converted into an allocated buffer
+  };
+
+  /** Options of the text (TSV, CSV) loader */
+  #define PCC_TEXT_NA_TOKENS "NA,NaN,nan,NAN,na,N/A,null,."
+  struct pcc_text_options {
+    char delim;             // field delimiter, 0 detects tab, comma or white space from the first data line
+    int header;             // number of header lines, the last one holds the column names, -1 detects a header
+    int labels;             // number of leading row label columns, -1 detects a label column
+    const char* na_tokens;  // comma separated tokens which mark missing values, empty fields are missing too
+  };
+
+  /** Read or write all bytes at offset */
+  bool pcc_file_pread(int fd, void* buf, size_t bytes, off_t offset);
+  bool pcc_file_pwrite(int fd, const void* buf, size_t bytes, off_t offset);
+  /** Open a matrix file and map it, with load the elements are made available in data */
+  bool pcc_file_open(const char* filename, pcc_matrix_file* f, bool load);
+  void pcc_file_close(pcc_matrix_file* f);
+  /** Read a text matrix file in parallel into an aligned buffer, rows are the variables */
+  void pcc_text_defaults(pcc_text_options* o);
+  bool pcc_text_read(const char* filename, const pcc_text_options* o, pcc_matrix_file* f);
+  /** Replace the na_value marker of a file in count loaded elements by NaN */
+  void pcc_file_fix_missing(const pcc_file_header* h, DataType* X, size_t count);
+  /** Create a row major rows x cols matrix file with (optional) names, the elements are written at PCC_FILE_DATA_OFFSET by the caller */
+  int pcc_file_create(const char* filename, int rows, int cols, char** rownames, char** colnames);
+  /** Write the row major rows x cols matrix X with optional names to a matrix file */
+  bool pcc_file_write(const char* filename, int rows, int cols, const DataType* X, char** rownames, char** colnames);
+
+#endif //__MPCCIO_H__
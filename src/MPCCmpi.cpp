@@ -0,0 +1,173 @@
+//Distributed memory (MPI) driver for the matrix PCC algorithm, built with make MPI=1
+// mpirun -np <ranks> ./MPCC [--block=<rows>] MatA_filename MatB_filename MatP_filename
+
+//The ranks form a Pr x Pc process grid and the m x p result is divided into blocks of mb x pb
+// elements, which are dealt out 2D block-cyclically: block (I, J) belongs to rank (I mod Pr, J mod Pc).
+// A rank therefore needs the row blocks I = r, r + Pr, ... of A and J = c, c + Pc, ... of B. It reads
+// them straight from the input files with a collective MPI-IO read through a cyclic file view, and all
+// of its result blocks together form one local (mloc x ploc) problem, solved with a single pcc_matrix
+// call (which tiles and threads it on the node). The local result is written into the shared result
+// file with one collective MPI-IO write through a darray file view, no rank holds more than its part.
+//The cyclic distribution keeps the ranks balanced when the missing values cluster in parts of A or B.
+
+//Matrix files use the binary format of MPCCio.h, the result file has the variable names of A and B as
+// row and column names.
+
+#include "MPCCio.h"
+
+#ifdef MPCC_MPI
+#ifndef NOBLAS
+#ifndef USING_R
+
+#include <mpi.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define mpi_err(rank, format, ...) { if (rank == 0) printf(format, __VA_ARGS__); MPI_Abort(MPI_COMM_WORLD, 1); }
+
+//Number of rows of the blocks me, me + procs, ... of a rows long dimension in blocks of block rows
+static int pcc_mpi_local_rows(int rows, int block, int procs, int me){
+  int count = 0;
+  for (long long b0 = (long long)me*block; b0 < rows; b0 += (long long)procs*block) {
+    count += (int)min((long long)block, rows - b0);
+  }
+  return count;
+}
+
+//Read the row blocks me, me + procs, ... of the matrix file f into X (rows_local x f->cols), all ranks
+// of MPI_COMM_WORLD take part in the collective read
+static bool pcc_mpi_read_rows(const char* filename, const pcc_matrix_file* f, int block, int procs, int me,
+                              DataType* X, int rows_local)
+{
+  MPI_File fh;
+  if (MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) return false;
+
+  //a variable (row) is contiguous in both layouts of the file, so the file is a cyclic array of rows
+  MPI_Datatype elem = (f->h.dtype == sizeof(double)) ? MPI_DOUBLE : MPI_FLOAT;
+  MPI_Datatype row, view;
+  int gsize = f->rows, distrib = MPI_DISTRIBUTE_CYCLIC, darg = block, psize = procs;
+  MPI_Type_contiguous(f->cols, elem, &row);
+  MPI_Type_commit(&row);
+  MPI_Type_create_darray(procs, me, 1, &gsize, &distrib, &darg, &psize, MPI_ORDER_C, row, &view);
+  MPI_Type_commit(&view);
+
+  //other element types are read into a buffer and converted
+  size_t count = (size_t)rows_local * f->cols;
+  bool convert = (f->h.dtype != sizeof(DataType));
+  void* buf = convert ? mkl_malloc( (count > 0 ? count : 1)*f->h.dtype, 64 ) : (void*)X;
+  bool ok = (buf != NULL);
+  ok &= (MPI_File_set_view(fh, PCC_FILE_DATA_OFFSET, elem, view, "native", MPI_INFO_NULL) == MPI_SUCCESS);
+  ok &= (MPI_File_read_all(fh, ok ? buf : NULL, ok ? rows_local : 0, row, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+  if (ok && convert) {
+    #pragma omp parallel for
+    for (size_t i=0; i<count; i++) {
+      X[i] = (f->h.dtype == sizeof(float)) ? (DataType)((const float*)buf)[i] : (DataType)((const double*)buf)[i];
+    }
+  }
+  if (ok) pcc_file_fix_missing(&f->h, X, count);
+
+  if (convert) mkl_free(buf);
+  MPI_Type_free(&view);
+  MPI_Type_free(&row);
+  MPI_File_close(&fh);
+  return ok;
+}
+
+//Compute the m x p PCC matrix between the rows of the matrices in matA_filename and matB_filename on
+// all ranks of MPI_COMM_WORLD, the result is written to matP_filename. block is the maximal number of
+// rows of A and B per block of the block-cyclic distribution.
+int pcc_mpi(const char* matA_filename, const char* matB_filename, const char* matP_filename, int block)
+{
+  int rank, ranks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+
+  pcc_matrix_file fa, fb;
+  if (matP_filename == NULL) mpi_err(rank, "\n ERROR: MPI mode needs MatA, MatB and MatP files. Aborting... %d\n\n", 0);
+  if (!pcc_file_open(matA_filename, &fa, false)) mpi_err(rank, "\n ERROR: Can't read binary matrix A from %s. Aborting... \n\n", matA_filename);
+  if (!pcc_file_open(matB_filename, &fb, false)) mpi_err(rank, "\n ERROR: Can't read binary matrix B from %s. Aborting... \n\n", matB_filename);
+  if (fa.cols != fb.cols) mpi_err(rank, "\n ERROR: Inner dimensions of A and B do not match: %d != %d. Aborting... \n\n", fa.cols, fb.cols);
+  int m = fa.rows;
+  int n = fa.cols;
+  int p = fb.rows;
+
+  //process grid, the longer side of the result gets the most process rows
+  int dims[2] = {0, 0};
+  MPI_Dims_create(ranks, 2, dims);
+  int Pr = (m >= p) ? dims[0] : dims[1];
+  int Pc = ranks / Pr;
+  int r = rank / Pc;
+  int c = rank % Pc;
+  int mb = max(1, min(block, (m + Pr - 1) / Pr));
+  int pb = max(1, min(block, (p + Pc - 1) / Pc));
+  int mloc = pcc_mpi_local_rows(m, mb, Pr, r);
+  int ploc = pcc_mpi_local_rows(p, pb, Pc, c);
+  if (rank == 0) {
+    printf("distributed m=%d n=%d p=%d on a %d x %d process grid, blocks of %d x %d\n", m, n, p, Pr, Pc, mb, pb);
+  }
+
+  DataType* A = (DataType*)mkl_malloc( ((size_t)mloc*n > 0 ? (size_t)mloc*n : 1)*sizeof(DataType), 64 );
+  DataType* B = (DataType*)mkl_malloc( ((size_t)ploc*n > 0 ? (size_t)ploc*n : 1)*sizeof(DataType), 64 );
+  DataType* P = (DataType*)mkl_malloc( ((size_t)mloc*ploc > 0 ? (size_t)mloc*ploc : 1)*sizeof(DataType), 64 );
+  int ok = (A != NULL) && (B != NULL) && (P != NULL);
+  MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+  if (!ok) mpi_err(rank, "\n ERROR: Can't allocate memory for the local blocks. Aborting... %d\n\n", 0);
+
+  double t0 = MPI_Wtime();
+  ok = pcc_mpi_read_rows(matA_filename, &fa, mb, Pr, r, A, mloc);
+  ok &= pcc_mpi_read_rows(matB_filename, &fb, pb, Pc, c, B, ploc);
+  MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+  if (!ok) mpi_err(rank, "\n ERROR: I/O error while reading %s and %s. Aborting... \n\n", matA_filename, matB_filename);
+
+  double t1 = MPI_Wtime();
+  if (mloc > 0 && ploc > 0) pcc_matrix(mloc, n, ploc, A, B, P);
+  double t2 = MPI_Wtime();
+
+  //rank 0 sizes the result file and writes header and names, then every rank writes its blocks
+  if (rank == 0) {
+    int fp = pcc_file_create(matP_filename, m, p, fa.rownames, fb.rownames);
+    ok = (fp >= 0) && (close(fp) == 0);
+  }
+  MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (!ok) mpi_err(rank, "\n ERROR: Can't write result matrix to %s. Aborting... \n\n", matP_filename);
+
+  MPI_File fh;
+  ok = (MPI_File_open(MPI_COMM_WORLD, matP_filename, MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) == MPI_SUCCESS);
+  if (ok) {
+    MPI_Datatype elem = (sizeof(DataType) == sizeof(double)) ? MPI_DOUBLE : MPI_FLOAT;
+    MPI_Datatype row, view;
+    int gsizes[2] = {m, p};
+    int distribs[2] = {MPI_DISTRIBUTE_CYCLIC, MPI_DISTRIBUTE_CYCLIC};
+    int dargs[2] = {mb, pb};
+    int psizes[2] = {Pr, Pc};
+    MPI_Type_create_darray(ranks, rank, 2, gsizes, distribs, dargs, psizes, MPI_ORDER_C, elem, &view);
+    MPI_Type_commit(&view);
+    MPI_Type_contiguous(ploc, elem, &row);
+    MPI_Type_commit(&row);
+    ok &= (MPI_File_set_view(fh, PCC_FILE_DATA_OFFSET, elem, view, "native", MPI_INFO_NULL) == MPI_SUCCESS);
+    ok &= (MPI_File_write_all(fh, P, (ploc > 0) ? mloc : 0, row, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+    ok &= (MPI_File_close(&fh) == MPI_SUCCESS);
+    MPI_Type_free(&row);
+    MPI_Type_free(&view);
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+  if (!ok) mpi_err(rank, "\n ERROR: I/O error while writing %s. Aborting... \n\n", matP_filename);
+  double t3 = MPI_Wtime();
+
+  //slowest rank per phase, the fastest compute shows the load imbalance
+  double times[4] = {t1 - t0, t2 - t1, t3 - t2, -(t2 - t1)};
+  MPI_Reduce((rank == 0) ? MPI_IN_PLACE : times, times, 4, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+  if (rank == 0) {
+    printf("ranks=%d read %e compute %e (fastest rank %e) write %e seconds\n", ranks, times[0], times[1], -times[3], times[2]);
+  }
+
+  mkl_free(A); mkl_free(B); mkl_free(P);
+  pcc_file_close(&fa);
+  pcc_file_close(&fb);
+  return 0;
+}
+
+#endif
+#endif
+#endif
@@ -1,55 +1,74 @@
 #include "MPCC.h"
 
+//Finish the PCC value of one row pair from its sums over the nn pairwise complete elements.
+//Same rule as pcc_value of the matrix version: pairs with less than two elements or without
+// variance give 0, rounding is clamped to a variance of at least 0 and |r| <= 1.
+static inline DataType pcc_naive_value(DataType sa, DataType sb, DataType saa, DataType sbb, DataType sab, int nn)
+{
+  //C[i*p+j] = (nn*sab - sa*sb) / sqrt( (nn*saa - sa*sa)*(nn*sbb - sb*sb) );
+  double den = fmax(0., (double)saa - (double)sa*sa/nn) * fmax(0., (double)sbb - (double)sb*sb/nn);
+  double r = (nn > 1 && den > 0.) ? ((double)sab - (double)sa*sb/nn) / sqrt(den) : 0.;
+  return (DataType)fmin(1., fmax(-1., r));
+}
+
 //This function is an implementation of a pairwise vector * vector correlation.
 //A is matrix of X vectors and B is transposed matrix of Y vectors:
 // C = [N sum(AB) - (sumA)(sumB)] /
 //     sqrt[ (N sumA^2 - (sum A)^2)[ (N sumB^2 - (sum B)^2) ]
+//Rows are processed in 2 x 2 register blocks (two rows of A against two rows of B), so every
+// loaded element is used twice. All accumulators are private to the block, blocks are distributed
+// over the OpenMP threads, and the inner loop masks missing pairs with a select instead of a branch.
 //int pcc_naive(int m, int n, int p, int count,
 int pcc_naive(int m, int n, int p,
-	      DataType* A, DataType* B, DataType* C)
+	      const DataType* A, const DataType* B, DataType* C)
 {
-  DataType sab,sa,sb,saa,sbb;
-  int nn;
-  int i,j,k;
-  int count=1;
+  int mblocks = (m + 1) / 2;
+  int pblocks = (p + 1) / 2;
 
   //sum_i( x[i]-x_mean[i])*(y[i]-y_mean[i]) ) /
   //     [ sqrt( sum_i(x[i]-x_mean[i])^2 ) sqrt(sum_i(y[i]-y_mean[i])^2 ) ]
-  for (int ii=0; ii<count; ii++) {
-    //Disabled pragma, because of weird sorting order errors #pragma omp parallel for private (i,j,k)
-    for (i=0; i<m; i++) {
-      for (j=0; j<p; j++) {
-
-        sa=0.0;
-        sb=0.0;
-        saa=0.0;
-        sbb=0.0;
-        sab=0.0;
-        nn=n;
-
-        for (k=0; k<n; k++) {
-          //if missing data exists decrement divisor for mean calculation
-          if (std::isnan(A[i*n+k]) || std::isnan(B[j*n+k])){
-             nn--;
-          }
-          else{
-             //compute components of PCC function
-             sa  += A[i*n+k];
-             sb  += B[j*n+k];
-             sab += A[i*n+k] * B[j*n+k];
-             saa += A[i*n+k] * A[i*n+k];
-             sbb += B[j*n+k] * B[j*n+k];
-          }
-        }
-          
-        if(nn>1){//Note edge case: if nn==1 then denominator is Zero! (saa==sa*sa, sbb==sb*sb)
-          //C[i*p+j] = (nn*sab - sa*sb) / sqrt( (nn*saa - sa*sa)*(nn*sbb - sb*sb) );
-          C[i*p+j] = (sab - sa*sb/nn) / sqrt( (saa - sa*sa/nn)*(sbb - sb*sb/nn) );
-          if( sqrt( (saa - sa*sa/nn)*(sbb - sb*sb/nn) ) ==0.0){printf("Error: R[%d,%d] denominator is zero! sa[%d]=%e sb[%d]=%e \n",i,j,i,sa,j,sb);}
-        }
-        else{/*printf("Error, no correlation possible for rows A[%d], B[%d]\n",i,j);*/ C[i*p+j]=0.0;}
-        //else{/*printf("Error, no correlation possible for rows A[%d], B[%d]\n",i,j);*/ C[i*p+j]=NANF;}
+  #pragma omp parallel for collapse(2) schedule(dynamic, 16)
+  for (int ib=0; ib<mblocks; ib++) {
+    for (int jb=0; jb<pblocks; jb++) {
+      //rows beyond the matrix are clamped to the last row, computed but not stored
+      int i0 = 2*ib, i1 = (2*ib+1 < m) ? 2*ib+1 : m-1;
+      int j0 = 2*jb, j1 = (2*jb+1 < p) ? 2*jb+1 : p-1;
+      const DataType* a0 = &A[(size_t)i0*n];
+      const DataType* a1 = &A[(size_t)i1*n];
+      const DataType* b0 = &B[(size_t)j0*n];
+      const DataType* b1 = &B[(size_t)j1*n];
+
+      DataType sa00=0.0, sb00=0.0, saa00=0.0, sbb00=0.0, sab00=0.0, nn00=0.0;
+      DataType sa01=0.0, sb01=0.0, saa01=0.0, sbb01=0.0, sab01=0.0, nn01=0.0;
+      DataType sa10=0.0, sb10=0.0, saa10=0.0, sbb10=0.0, sab10=0.0, nn10=0.0;
+      DataType sa11=0.0, sb11=0.0, saa11=0.0, sbb11=0.0, sab11=0.0, nn11=0.0;
+
+      #pragma omp simd reduction(+:sa00,sb00,saa00,sbb00,sab00,nn00,sa01,sb01,saa01,sbb01,sab01,nn01,\
+                                   sa10,sb10,saa10,sbb10,sab10,nn10,sa11,sb11,saa11,sbb11,sab11,nn11)
+      for (int k=0; k<n; k++) {
+        DataType x0 = a0[k], x1 = a1[k], y0 = b0[k], y1 = b1[k];
+        bool ok_x0 = !CHECKNA(x0), ok_x1 = !CHECKNA(x1), ok_y0 = !CHECKNA(y0), ok_y1 = !CHECKNA(y1);
+        //if missing data exists the pair does not contribute to the sums nor the divisor
+        DataType x, y;
+        bool ok;
+
+        ok = ok_x0 && ok_y0; x = ok ? x0 : 0.0; y = ok ? y0 : 0.0;
+        sa00 += x; sb00 += y; sab00 += x*y; saa00 += x*x; sbb00 += y*y; nn00 += ok ? 1.0 : 0.0;
+
+        ok = ok_x0 && ok_y1; x = ok ? x0 : 0.0; y = ok ? y1 : 0.0;
+        sa01 += x; sb01 += y; sab01 += x*y; saa01 += x*x; sbb01 += y*y; nn01 += ok ? 1.0 : 0.0;
+
+        ok = ok_x1 && ok_y0; x = ok ? x1 : 0.0; y = ok ? y0 : 0.0;
+        sa10 += x; sb10 += y; sab10 += x*y; saa10 += x*x; sbb10 += y*y; nn10 += ok ? 1.0 : 0.0;
+
+        ok = ok_x1 && ok_y1; x = ok ? x1 : 0.0; y = ok ? y1 : 0.0;
+        sa11 += x; sb11 += y; sab11 += x*y; saa11 += x*x; sbb11 += y*y; nn11 += ok ? 1.0 : 0.0;
       }
+
+      C[(size_t)i0*p+j0] = pcc_naive_value(sa00, sb00, saa00, sbb00, sab00, (int)nn00);
+      if (j1 != j0) C[(size_t)i0*p+j1] = pcc_naive_value(sa01, sb01, saa01, sbb01, sab01, (int)nn01);
+      if (i1 != i0) C[(size_t)i1*p+j0] = pcc_naive_value(sa10, sb10, saa10, sbb10, sab10, (int)nn10);
+      if (i1 != i0 && j1 != j0) C[(size_t)i1*p+j1] = pcc_naive_value(sa11, sb11, saa11, sbb11, sab11, (int)nn11);
     }
   }
   return 0;
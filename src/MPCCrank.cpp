@@ -0,0 +1,177 @@
+//Spearman rank correlation on top of the PCC algorithms
+//Every row is replaced by its ranks (tied values get their average rank, missing values stay NaN) and
+// the PCC of the ranks is computed with the matrix algorithm.
+
+//With missing values the rank of a value depends on which observations take part: the single ranking
+// pass ranks all observed values of a row, while the Spearman correlation of a pair (as computed by R's
+// cor(method = "spearman", use = "pairwise")) ranks only the observations which both rows have. Both
+// agree when the two rows are complete or miss the same observations. The exact mode re-ranks every
+// other pair on its pairwise complete observations, which costs O(n) per pair on top of the matrix
+// algorithm (the rows are sorted once, a re-rank filters the sorted order). The approximate mode
+// keeps the result of the single ranking pass, it is exact for complete data.
+
+#include "MPCC.h"
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+//Ranks of the observed values of a row and their positions sorted on value
+struct pcc_ranks {
+  int rows;
+  int n;
+  int words;        //uint64_t words per row of bits
+  DataType* R;      //rows x n ranks, NaN where X is missing
+  int* order;       //rows x n, the first count[i] entries are the observed positions sorted on value
+  int* count;       //observed values per row
+  uint64_t* bits;   //rows x words observed masks
+};
+
+static void pcc_ranks_free(pcc_ranks* rk){
+  mkl_free(rk->R); mkl_free(rk->order); mkl_free(rk->count); mkl_free(rk->bits);
+}
+
+//Average ranks (1 based) of the values X[order[0..cnt-1]], which are sorted on value, written to R at
+// the positions in order. Only positions which are observed in other (when not NULL) take part, the
+// number of ranked values is returned.
+static int pcc_rank_sorted(const int* order, int cnt, const DataType* X, const DataType* other, DataType* R)
+{
+  int k = 0, rank = 0;
+  while (k < cnt) {
+    //the next group of tied values, skipping the positions missing in other
+    int first = k, ties = 0;
+    DataType value = X[order[k]];
+    for (; k < cnt && X[order[k]] == value; k++) {
+      if (other == NULL || !std::isnan(other[order[k]])) ties++;
+    }
+    DataType avg = rank + (ties + 1) * 0.5;
+    for (int e = first; e < k; e++) {
+      if (other == NULL || !std::isnan(other[order[e]])) R[order[e]] = avg;
+    }
+    rank += ties;
+  }
+  return rank;
+}
+
+//Rank all rows of X (rows x n) in parallel, returns false if memory could not be allocated
+static bool pcc_ranks_init(pcc_ranks* rk, int rows, int n, const DataType* X)
+{
+  rk->rows = rows;
+  rk->n = n;
+  rk->words = (n + 63) / 64;
+  size_t elems = ((size_t)rows*n > 0) ? (size_t)rows*n : 1;
+  rk->R = (DataType*)mkl_malloc( elems*sizeof(DataType), 64 );
+  rk->order = (int*)mkl_malloc( elems*sizeof(int), 64 );
+  rk->count = (int*)mkl_malloc( (rows > 0 ? rows : 1)*sizeof(int), 64 );
+  rk->bits = (uint64_t*)mkl_calloc( ((size_t)rows*rk->words > 0 ? (size_t)rows*rk->words : 1), sizeof(uint64_t), 64 );
+  if ( (rk->R == NULL) | (rk->order == NULL) | (rk->count == NULL) | (rk->bits == NULL) ) return false;
+
+  #pragma omp parallel for schedule(dynamic, 16)
+  for (int i=0; i<rows; i++) {
+    const DataType* x = &X[(size_t)i*n];
+    DataType* r = &rk->R[(size_t)i*n];
+    int* order = &rk->order[(size_t)i*n];
+    uint64_t* bits = &rk->bits[(size_t)i*rk->words];
+    int cnt = 0;
+    for (int k=0; k<n; k++) {
+      r[k] = MISSING_MARKER;
+      if (!std::isnan(x[k])) {
+        order[cnt++] = k;
+        bits[k / 64] |= (uint64_t)1 << (k % 64);
+      }
+    }
+    std::sort(order, order + cnt, [x](int a, int b) { return x[a] < x[b]; });
+    rk->count[i] = cnt;
+    pcc_rank_sorted(order, cnt, x, NULL, r);
+  }
+  return true;
+}
+
+//Spearman correlation of row i of a and row j of b on their pairwise complete observations, ra and rb
+// are n element buffers
+static DataType pcc_rank_pair(const pcc_ranks* a, const DataType* A, int i, const pcc_ranks* b,
+                              const DataType* B, int j, DataType* ra, DataType* rb)
+{
+  int n = a->n;
+  const DataType* x = &A[(size_t)i*n];
+  const DataType* y = &B[(size_t)j*n];
+  const int* oa = &a->order[(size_t)i*n];
+  int nn = pcc_rank_sorted(oa, a->count[i], x, y, ra);
+  pcc_rank_sorted(&b->order[(size_t)j*n], b->count[j], y, x, rb);
+  if (nn < 2) return 0.0;
+
+  //the ranks of both rows have mean (nn + 1) / 2
+  double mean = (nn + 1) * 0.5, sab = 0.0, saa = 0.0, sbb = 0.0;
+  for (int e=0; e<a->count[i]; e++) {
+    int k = oa[e];
+    if (std::isnan(y[k])) continue;
+    double da = ra[k] - mean, db = rb[k] - mean;
+    sab += da * db;
+    saa += da * da;
+    sbb += db * db;
+  }
+  double den = saa * sbb;
+  return (den > 0.0) ? (DataType)(sab / sqrt(den)) : 0.0;
+}
+
+//Spearman rank correlation between the rows of A (m x n) and B (p x n), P is the m x p result, with
+// B == NULL the rows of A are correlated with each other (p = m). With exact the pairs whose rows miss
+// different observations are re-ranked on their pairwise complete observations, otherwise the ranks of
+// the single ranking pass are used for every pair.
+int pcc_spearman(int m, int n, int p, const DataType* A, const DataType* B, DataType* P, bool exact)
+{
+  bool sym = (B == NULL);
+  if (sym) p = m;
+
+  pcc_ranks a, b;
+  a.R = b.R = NULL; a.order = b.order = NULL; a.count = b.count = NULL; a.bits = b.bits = NULL;
+  bool ok = pcc_ranks_init(&a, m, n, A) && (sym || pcc_ranks_init(&b, p, n, B));
+  const pcc_ranks* rb = sym ? &a : &b;
+
+  if (ok) {
+    //PCC of the ranks
+    #ifndef NOBLAS
+    if (sym) pcc_matrix_sym(m, n, a.R, P);
+    else pcc_matrix(m, n, p, a.R, b.R, P);
+    #else
+    pcc_naive(m, n, p, a.R, rb->R, P);
+    #endif
+  }
+
+  if (ok && exact) {
+    if (B == NULL) B = A;
+    int words = a.words;
+    #pragma omp parallel
+    {
+      vector<DataType> ra(n), rbuf(n);
+      #pragma omp for schedule(dynamic, 4)
+      for (int i=0; i<m; i++) {
+        const uint64_t* bi = &a.bits[(size_t)i*words];
+        for (int j=(sym ? i + 1 : 0); j<p; j++) {
+          if (a.count[i] == n && rb->count[j] == n) continue;
+          const uint64_t* bj = &rb->bits[(size_t)j*words];
+          bool same = true;
+          for (int w=0; w<words && same; w++) same = (bi[w] == bj[w]);
+          if (same) continue;
+          DataType r = pcc_rank_pair(&a, A, i, rb, B, j, ra.data(), rbuf.data());
+          P[(size_t)i*p + j] = r;
+          if (sym) P[(size_t)j*p + i] = r;
+        }
+      }
+    }
+  }
+
+  pcc_ranks_free(&a);
+  if (!sym) pcc_ranks_free(&b);
+
+  if (!ok) {
+    printf( "\n ERROR: Can't allocate memory for the ranks. Aborting... \n\n");
+    #ifndef USING_R
+    exit (0);
+    #else
+    return(0);
+    #endif
+  }
+  return 0;
+};
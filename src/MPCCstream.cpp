@@ -0,0 +1,145 @@
+//Out-of-core (streaming) driver for the matrix PCC algorithm
+// ./MPCC MatA_filename MatB_filename MatP_filename [budget_MB]
+
+//A (m x n) and B (p x n) are streamed from disk in row panels, every pair of panels is computed with
+// pcc_matrix and the finished result panel is written to its place in the m x p output file. Only two
+// panels of A, two panels of B and two result panels are in memory at any time, their size follows
+// from the memory budget. Disk I/O overlaps with compute: while pcc_matrix works on step s, an I/O
+// thread writes the result of step s-1 and reads the panels of step s+1 (double buffering).
+
+//Matrix files use the binary format of MPCCio.h, the result file has the variable names of A and B as
+// row and column names.
+
+#include "MPCCio.h"
+
+#ifndef NOBLAS
+#ifndef USING_R
+
+#include <unistd.h>
+#include <thread>
+
+using namespace std;
+
+//Rows per panel of A (mb) and B (pb) such that the double buffered input panels (2*(mb+pb)*n), the
+// result panels (2*mb*pb) and the packed copies made by pcc_matrix (X, XX and Z: 3*(mb+pb)*n) fit in
+// the budget. Panels are square, unless A or B fits completely in which case the other one grows.
+static void pcc_stream_panels(int m, int n, int p, size_t budget, int* mb, int* pb){
+  double words = (double)budget / sizeof(DataType);
+  // 2 r^2 + 10 r n <= words
+  double r = (-10.0*n + sqrt(100.0*n*n + 8.0*words)) / 4.0;
+  *mb = (r < m) ? (int)r : m;
+  *pb = (r < p) ? (int)r : p;
+  if (*pb == p && *mb < m) { //B fits, use the rest for A
+    r = (words - 5.0*p*n) / (5.0*n + 2.0*p);
+    *mb = (r < m) ? (int)r : m;
+  } else if (*mb == m && *pb < p) { //A fits, use the rest for B
+    r = (words - 5.0*m*n) / (5.0*n + 2.0*m);
+    *pb = (r < p) ? (int)r : p;
+  }
+}
+
+//Compute the m x p PCC matrix between the rows of the matrices in matA_filename and matB_filename,
+// the result is written to matP_filename. At most budget bytes (approximately, the tile scratch of
+// pcc_matrix comes on top) are used for panels.
+int pcc_stream(const char* matA_filename, const char* matB_filename, const char* matP_filename, size_t budget)
+{
+  pcc_matrix_file fa, fb;
+  if (!pcc_file_open(matA_filename, &fa, false)) err("\n ERROR: Can't read matrix A from %s. Aborting... \n\n", matA_filename);
+  if (!pcc_file_open(matB_filename, &fb, false)) err("\n ERROR: Can't read matrix B from %s. Aborting... \n\n", matB_filename);
+  if (fa.h.dtype != sizeof(DataType) || fb.h.dtype != sizeof(DataType)) err("\n ERROR: Element size of the input files should be %d. Aborting... \n\n", (int)sizeof(DataType));
+  if (fa.cols != fb.cols) err("\n ERROR: Inner dimensions of A and B do not match: %d != %d. Aborting... \n\n", fa.cols, fb.cols);
+  int m = fa.rows;
+  int n = fa.cols;
+  int p = fb.rows;
+
+  int mb, pb;
+  pcc_stream_panels(m, n, p, budget, &mb, &pb);
+  if (mb < 1 || pb < 1) err("\n ERROR: Memory budget of %zu bytes is too small for n=%d. Aborting... \n\n", budget, n);
+  int na = (m + mb - 1) / mb;
+  int nb = (p + pb - 1) / pb;
+  int steps = na * nb;
+  info("streaming m=%d n=%d p=%d in panels of %d x %d rows, %d steps\n", m, n, p, mb, pb, steps);
+
+  int fp = pcc_file_create(matP_filename, m, p, fa.rownames, fb.rownames);
+  if (fp < 0) err("\n ERROR: Can't write result matrix to %s. Aborting... \n\n", matP_filename);
+
+  //plan the panel loads of every step: the A panel changes every nb steps, the B panel every step
+  // (or never if B fits), every new panel goes into the other buffer of its pair
+  int* slotA = (int*)mkl_malloc( 4*steps*sizeof(int), 64 );
+  int* slotB = &slotA[steps];
+  int* loadA = &slotA[2*steps];
+  int* loadB = &slotA[3*steps];
+  DataType* bufA[2];
+  DataType* bufB[2];
+  DataType* bufP[2];
+  for (int k=0; k<2; k++) {
+    bufA[k] = (DataType*)mkl_malloc( ((size_t)mb*n > 0 ? (size_t)mb*n : 1)*sizeof(DataType), 64 );
+    bufB[k] = (DataType*)mkl_malloc( ((size_t)pb*n > 0 ? (size_t)pb*n : 1)*sizeof(DataType), 64 );
+    bufP[k] = (DataType*)mkl_malloc( (size_t)mb*pb*sizeof(DataType), 64 );
+  }
+  //one pcc_matrix workspace, sized for the largest step and reused by all steps
+  pcc_workspace ws = { NULL, 0 };
+  if ( (slotA == NULL) | (bufA[0] == NULL) | (bufA[1] == NULL) | (bufB[0] == NULL) | (bufB[1] == NULL) |
+       (bufP[0] == NULL) | (bufP[1] == NULL) | !pcc_workspace_reserve(&ws, pcc_workspace_bytes(mb, n, pb)) ) {
+    err("\n ERROR: Can't allocate memory for the stream panels. Aborting... %d\n\n", 0);
+  }
+  for (int s=0; s<steps; s++) {
+    loadA[s] = (s == 0) || (s % nb == 0);
+    loadB[s] = (s == 0) || (nb > 1);
+    slotA[s] = (s == 0) ? 0 : slotA[s-1] ^ loadA[s];
+    slotB[s] = (s == 0) ? 0 : slotB[s-1] ^ loadB[s];
+  }
+
+  //read the panels of step s, write the result panel of step s
+  const off_t data = PCC_FILE_DATA_OFFSET;
+  auto read_panel = [&](pcc_matrix_file* f, DataType* X, int r0, int rows) -> bool {
+    if (!pcc_file_pread(f->fd, X, (size_t)rows*n*sizeof(DataType), data + (off_t)r0*n*sizeof(DataType))) return false;
+    pcc_file_fix_missing(&f->h, X, (size_t)rows*n);
+    return true;
+  };
+  auto read_step = [&](int s) -> bool {
+    int i0 = (s / nb) * mb, j0 = (s % nb) * pb;
+    bool ok = true;
+    if (loadA[s]) ok &= read_panel(&fa, bufA[slotA[s]], i0, min(mb, m - i0));
+    if (loadB[s]) ok &= read_panel(&fb, bufB[slotB[s]], j0, min(pb, p - j0));
+    return ok;
+  };
+  auto write_step = [&](int s) -> bool {
+    int i0 = (s / nb) * mb, j0 = (s % nb) * pb;
+    int mbs = min(mb, m - i0), pbs = min(pb, p - j0);
+    bool ok = true;
+    for (int i=0; i<mbs && ok; i++) {
+      ok = pcc_file_pwrite(fp, &bufP[s & 1][(size_t)i*pbs], (size_t)pbs*sizeof(DataType),
+                           data + ((off_t)(i0 + i)*p + j0)*sizeof(DataType));
+    }
+    return ok;
+  };
+
+  bool ok = read_step(0);
+  for (int s=0; s<steps && ok; s++) {
+    int i0 = (s / nb) * mb, j0 = (s % nb) * pb;
+    bool io_ok = true;
+    thread io([&]() {
+      if (s > 0) io_ok &= write_step(s - 1);
+      if (s + 1 < steps) io_ok &= read_step(s + 1);
+    });
+    pcc_matrix(min(mb, m - i0), n, min(pb, p - j0), bufA[slotA[s]], bufB[slotB[s]], bufP[s & 1], &ws);
+    io.join();
+    ok = io_ok;
+  }
+  if (ok && steps > 0) ok = write_step(steps - 1);
+
+  for (int k=0; k<2; k++) {
+    mkl_free(bufA[k]); mkl_free(bufB[k]); mkl_free(bufP[k]);
+  }
+  mkl_free(slotA);
+  pcc_workspace_free(&ws);
+  pcc_file_close(&fa);
+  pcc_file_close(&fb);
+  if (close(fp) != 0) ok = false;
+  if (!ok) err("\n ERROR: I/O error while streaming to %s. Aborting... \n\n", matP_filename);
+  return 0;
+}
+
+#endif
+#endif
@@ -0,0 +1,372 @@
+//Parallel loader for text (TSV, CSV or white space separated) matrix files of the standalone executable
+//The file is memory mapped and split at line boundaries into one chunk per thread. Every thread
+// counts the lines in its chunk, after a prefix sum over the counts every thread parses its lines
+// directly into the aligned rows x cols buffer used by the algorithms. Numbers are parsed in place
+// (no string copies), only numbers which can not be converted exactly by the fast path fall back
+// to strtod.
+
+//Rows are the variables, columns the observations. Optionally the file has a header line with
+// column names and/or leading columns with row labels. Fields matching one of the NA tokens, and
+// empty fields, are missing values.
+
+//The old text format (rows and cols on the first two lines, followed by one value per line) is
+// recognized and read as a rows x cols matrix.
+
+#include "MPCCio.h"
+
+#ifndef USING_R
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <vector>
+
+#define PCC_TEXT_MAX_NA 32
+
+struct pcc_text_na {
+  int count;
+  const char* token[PCC_TEXT_MAX_NA];
+  int length[PCC_TEXT_MAX_NA];
+};
+
+//One line of the file, without the line ending
+struct pcc_text_line {
+  const char* begin;
+  const char* end;
+};
+
+void pcc_text_defaults(pcc_text_options* o){
+  o->delim = 0;
+  o->header = -1;
+  o->labels = -1;
+  o->na_tokens = PCC_TEXT_NA_TOKENS;
+}
+
+static void pcc_text_na_tokens(const char* tokens, pcc_text_na* na){
+  na->count = 0;
+  const char* p = tokens;
+  while (p != NULL && *p != '\0' && na->count < PCC_TEXT_MAX_NA) {
+    const char* e = strchr(p, ',');
+    if (e == NULL) e = p + strlen(p);
+    if (e > p) {
+      na->token[na->count] = p;
+      na->length[na->count] = (int)(e - p);
+      na->count++;
+    }
+    p = (*e == ',') ? e + 1 : e;
+  }
+}
+
+static inline bool pcc_text_is_na(const char* s, const char* e, const pcc_text_na* na){
+  if (s == e) return true;
+  for (int i=0; i<na->count; i++) {
+    if (na->length[i] == (int)(e - s) && memcmp(na->token[i], s, e - s) == 0) return true;
+  }
+  return false;
+}
+
+//Next line starting at p, returns false at the end of the buffer
+static inline bool pcc_text_next_line(const char*& p, const char* end, pcc_text_line* line){
+  if (p >= end) return false;
+  const char* eol = (const char*)memchr(p, '\n', end - p);
+  if (eol == NULL) eol = end;
+  line->begin = p;
+  line->end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+  p = eol + 1;
+  return true;
+}
+
+static inline bool pcc_text_blank(const pcc_text_line* line){
+  for (const char* c = line->begin; c < line->end; c++) {
+    if (*c != ' ' && *c != '\t') return false;
+  }
+  return true;
+}
+
+//Next field of a line starting at p, surrounding white space and quotes are stripped.
+//With delim 0 fields are separated by runs of white space. Returns false after the last field.
+static inline bool pcc_text_next_field(const char*& p, const char* end, char delim, const char** fs, const char** fe){
+  if (delim == 0) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p >= end) return false;
+    const char* s = p;
+    while (p < end && *p != ' ' && *p != '\t') p++;
+    *fs = s; *fe = p;
+  } else {
+    if (p > end) return false;
+    const char* s = p;
+    const char* e = (const char*)memchr(p, delim, end - p);
+    if (e == NULL) e = end;
+    p = e + 1;
+    while (s < e && (*s == ' ' || *s == '\t')) s++;
+    while (e > s && (e[-1] == ' ' || e[-1] == '\t')) e--;
+    *fs = s; *fe = e;
+  }
+  if (*fe - *fs >= 2 && (**fs == '"' || **fs == '\'') && (*fe)[-1] == **fs) { (*fs)++; (*fe)--; }
+  return true;
+}
+
+//Parse a decimal number in [s, e) with strtod, for numbers the fast path can not convert exactly
+static bool pcc_text_parse_slow(const char* s, const char* e, double* out){
+  char buffer[128];
+  if (e - s >= (long)sizeof(buffer)) return false;
+  memcpy(buffer, s, e - s);
+  buffer[e - s] = '\0';
+  char* end;
+  *out = strtod(buffer, &end);
+  return (end == &buffer[e - s]) && (e > s);
+}
+
+//Parse a decimal number in [s, e), returns false if the field is not a number.
+//Mantissas below 2^53 with a decimal exponent below 23 are exact as double, and a single
+// multiplication or division by an exact power of 10 is correctly rounded (as strtod).
+static inline bool pcc_text_parse(const char* s, const char* e, double* out){
+  static const double pow10[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char* p = s;
+  bool negative = false;
+  if (p < e && (*p == '-' || *p == '+')) { negative = (*p == '-'); p++; }
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool any = false, exact = true;
+  for (; p < e && *p >= '0' && *p <= '9'; p++) {
+    any = true;
+    if (digits < 19) { mantissa = mantissa*10 + (*p - '0'); if (mantissa) digits++; }
+    else { exponent++; exact = false; }
+  }
+  if (p < e && *p == '.') {
+    for (p++; p < e && *p >= '0' && *p <= '9'; p++) {
+      any = true;
+      if (digits < 19) { mantissa = mantissa*10 + (*p - '0'); if (mantissa) digits++; exponent--; }
+      else if (*p != '0') exact = false;
+    }
+  }
+  if (!any) return pcc_text_parse_slow(s, e, out); //inf, infinity, hexadecimal
+  if (p < e && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool eneg = false;
+    if (p < e && (*p == '-' || *p == '+')) { eneg = (*p == '-'); p++; }
+    if (p >= e) return false;
+    int ev = 0;
+    for (; p < e && *p >= '0' && *p <= '9'; p++) if (ev < 100000) ev = ev*10 + (*p - '0');
+    exponent += eneg ? -ev : ev;
+  }
+  if (p != e) return false;
+  if (!exact || mantissa > ((uint64_t)1 << 53) || exponent < -22 || exponent > 22) return pcc_text_parse_slow(s, e, out);
+  double v = (double)mantissa;
+  v = (exponent < 0) ? v / pow10[-exponent] : v * pow10[exponent];
+  *out = negative ? -v : v;
+  return true;
+}
+
+//Number of fields of a line
+static int pcc_text_fields(const pcc_text_line* line, char delim){
+  const char* p = line->begin;
+  const char *fs, *fe;
+  int count = 0;
+  while (pcc_text_next_field(p, line->end, delim, &fs, &fe)) count++;
+  return count;
+}
+
+//Does the line have a field at or after position from which is not a number (nor NA)
+static bool pcc_text_has_text(const pcc_text_line* line, char delim, int from, int to, const pcc_text_na* na){
+  const char* p = line->begin;
+  const char *fs, *fe;
+  double v;
+  for (int i=0; i<to && pcc_text_next_field(p, line->end, delim, &fs, &fe); i++) {
+    if (i >= from && !pcc_text_is_na(fs, fe, na) && !pcc_text_parse(fs, fe, &v)) return true;
+  }
+  return false;
+}
+
+//Copy the names into one buffer and point f->names into it, names are rows names followed by cols names
+static bool pcc_text_names(pcc_matrix_file* f, std::vector<pcc_text_line>& names){
+  size_t bytes = 0;
+  for (size_t i=0; i<names.size(); i++) bytes += (names[i].end - names[i].begin) + 1;
+  f->namebuf = (char*)malloc(bytes > 0 ? bytes : 1);
+  f->names = (char**)malloc( (names.size() > 0 ? names.size() : 1)*sizeof(char*) );
+  if (f->namebuf == NULL || f->names == NULL) return false;
+  char* ptr = f->namebuf;
+  for (size_t i=0; i<names.size(); i++) {
+    size_t len = names[i].end - names[i].begin;
+    memcpy(ptr, names[i].begin, len);
+    ptr[len] = '\0';
+    f->names[i] = ptr;
+    ptr += len + 1;
+  }
+  f->rownames = f->names;
+  f->colnames = &f->names[f->rows];
+  return true;
+}
+
+bool pcc_text_read(const char* filename, const pcc_text_options* o, pcc_matrix_file* f){
+  f->fd = -1; f->data = NULL; f->map = NULL; f->map_size = 0;
+  f->rownames = f->colnames = f->names = NULL; f->namebuf = NULL; f->copied = false;
+  memset(&f->h, 0, sizeof(f->h));
+  if (filename == NULL) return false;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  off_t size = lseek(fd, 0, SEEK_END);
+  const char* text = (size > 0) ? (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (text == NULL || text == MAP_FAILED) return false;
+  madvise((void*)text, size, MADV_WILLNEED);
+  const char* end = text + size;
+
+  pcc_text_na na;
+  pcc_text_na_tokens(o->na_tokens, &na);
+  bool ok = true;
+
+  //the first two non blank lines decide on the delimiter, header and label columns
+  const char* p = text;
+  pcc_text_line first, second, line;
+  bool found = false;
+  while ((found = pcc_text_next_line(p, end, &first)) && pcc_text_blank(&first));
+  if (!found) {
+    munmap((void*)text, size);
+    return false;
+  }
+  second = first;
+  while (pcc_text_next_line(p, end, &line)) if (!pcc_text_blank(&line)) { second = line; break; }
+  char delim = o->delim;
+  if (delim == 0 && memchr(second.begin, '\t', second.end - second.begin) != NULL) delim = '\t';
+  if (delim == 0 && memchr(second.begin, ',', second.end - second.begin) != NULL) delim = ',';
+  if (delim == ' ') delim = 0;
+  int header = o->header;
+  int labels = o->labels;
+  if (header < 0) header = pcc_text_has_text(&first, delim, 1, pcc_text_fields(&first, delim), &na) ? 1 : 0;
+  const char* data = text;
+  std::vector<pcc_text_line> headers;
+  for (int i=0; i<header; i++) {
+    while ((found = pcc_text_next_line(data, end, &line)) && pcc_text_blank(&line));
+    if (found) headers.push_back(line);
+  }
+  const char* q = data;
+  while ((found = pcc_text_next_line(q, end, &line)) && pcc_text_blank(&line));
+  int fields = found ? pcc_text_fields(&line, delim) : 0;
+  if (labels < 0) labels = (found && pcc_text_has_text(&line, delim, 0, 1, &na)) ? 1 : 0;
+  int cols = fields - labels;
+  if (cols < 1) {
+    munmap((void*)text, size);
+    return false;
+  }
+
+  //split the data lines into one chunk per thread, at line boundaries
+#ifdef _OPENMP
+  int threads = omp_get_max_threads();
+#else
+  int threads = 1;
+#endif
+  std::vector<const char*> chunk(threads + 1);
+  std::vector<int> lines(threads + 1, 0);
+  chunk[0] = data;
+  for (int t=1; t<threads; t++) {
+    const char* c = data + (end - data) * t / threads;
+    if (c < chunk[t-1]) c = chunk[t-1];
+    const char* eol = (const char*)memchr(c, '\n', end - c);
+    chunk[t] = (eol == NULL) ? end : eol + 1;
+  }
+  chunk[threads] = end;
+
+  #pragma omp parallel num_threads(threads)
+  {
+#ifdef _OPENMP
+    int t = omp_get_thread_num();
+#else
+    int t = 0;
+#endif
+    const char* c = chunk[t];
+    pcc_text_line l;
+    int count = 0;
+    while (c < chunk[t+1] && pcc_text_next_line(c, chunk[t+1], &l)) if (!pcc_text_blank(&l)) count++;
+    lines[t+1] = count;
+  }
+  for (int t=0; t<threads; t++) lines[t+1] += lines[t];
+  int rows = lines[threads];
+
+  f->data = (DataType*)mkl_malloc( ((size_t)rows*cols > 0 ? (size_t)rows*cols : 1)*sizeof(DataType), 64 );
+  if (f->data == NULL) {
+    printf( "\n ERROR: Can't allocate memory for matrix %s. Aborting... \n\n", filename);
+    munmap((void*)text, size);
+    return false;
+  }
+  f->copied = true;
+  std::vector<pcc_text_line> names(labels > 0 ? rows : 0);
+  int bad_row = -1;
+
+  #pragma omp parallel num_threads(threads)
+  {
+#ifdef _OPENMP
+    int t = omp_get_thread_num();
+#else
+    int t = 0;
+#endif
+    const char* c = chunk[t];
+    pcc_text_line l;
+    int row = lines[t];
+    while (c < chunk[t+1] && pcc_text_next_line(c, chunk[t+1], &l)) {
+      if (pcc_text_blank(&l)) continue;
+      const char* fp = l.begin;
+      const char *fs, *fe;
+      DataType* x = &f->data[(size_t)row*cols];
+      int k = 0;
+      double v;
+      for (int i=0; pcc_text_next_field(fp, l.end, delim, &fs, &fe); i++) {
+        if (i < labels) {
+          if (i == 0) { names[row].begin = fs; names[row].end = fe; }
+          continue;
+        }
+        if (k >= cols) { k = cols + 1; break; }
+        if (pcc_text_is_na(fs, fe, &na)) x[k++] = MISSING_MARKER;
+        else if (pcc_text_parse(fs, fe, &v)) x[k++] = (DataType)v;
+        else { k = cols + 1; break; }
+      }
+      if (k != cols) {
+        #pragma omp critical
+        if (bad_row < 0 || row < bad_row) bad_row = row;
+      }
+      row++;
+    }
+  }
+  if (bad_row >= 0) {
+    printf("\n ERROR: Data line %d of %s does not have %d numeric or NA fields. Aborting... \n\n", bad_row + 1, filename, cols);
+    ok = false;
+  }
+
+  //the old format: rows and cols on the first two lines, followed by one value per line
+  if (ok && cols == 1 && header == 0 && labels == 0 && rows >= 2 && f->data[0] >= 0 && f->data[1] >= 0 &&
+      f->data[0] == (int)f->data[0] && f->data[1] == (int)f->data[1] && (size_t)f->data[0] * f->data[1] == (size_t)rows - 2) {
+    rows = (int)f->data[0];
+    cols = (int)f->data[1];
+    memmove(f->data, &f->data[2], (size_t)rows*cols*sizeof(DataType));
+  }
+  f->rows = rows;
+  f->cols = cols;
+  f->h.rows = rows;
+  f->h.cols = cols;
+  f->h.dtype = sizeof(DataType);
+
+  //row labels and column names from the last header line, which may or may not name the label columns
+  if (ok && (labels > 0 || header > 0)) {
+    std::vector<pcc_text_line> header_names;
+    if (header > 0) {
+      const char* hp = headers[header-1].begin;
+      pcc_text_line h;
+      while (pcc_text_next_field(hp, headers[header-1].end, delim, &h.begin, &h.end)) header_names.push_back(h);
+    }
+    int skip = (header > 0) ? (int)header_names.size() - cols : 0;
+    pcc_text_line empty = {data, data};
+    names.resize(rows, empty);
+    for (int j=0; j<cols; j++) names.push_back((header > 0 && skip >= 0) ? header_names[skip + j] : empty);
+    if (header > 0 && skip < 0) printf("Header of %s has %d names for %d columns, ignored\n", filename, (int)header_names.size(), cols);
+    ok = pcc_text_names(f, names);
+  }
+  munmap((void*)text, size);
+  if (!ok) pcc_file_close(f);
+  return ok;
+}
+
+#endif
@@ -4,9 +4,25 @@
 #include <Rinternals.h>
 #include <R_ext/Rdynload.h>
 #include "R_init.h"
+#include "interface.h"
 
-void R_init_mpcc(DllInfo* info) {
-    R_registerRoutines(info, NULL, NULL, NULL, NULL);
-    R_useDynamicSymbols(info, TRUE);
+static const R_CallMethodDef CallEntries[] = {
+    {"R_pcc", (DL_FUNC) &R_pcc, 3},
+    {"R_pcc_sparse", (DL_FUNC) &R_pcc_sparse, 6},
+    {"R_pcc_stats", (DL_FUNC) &R_pcc_stats, 2},
+    {"R_spearman", (DL_FUNC) &R_spearman, 3},
+    {"R_pcc_batch", (DL_FUNC) &R_pcc_batch, 3},
+    {"R_pcc_groups", (DL_FUNC) &R_pcc_groups, 3},
+    {NULL, NULL, 0}
+};
+
+// R looks up R_init_<package>, the package (and shared library) is called MPCC
+extern "C" void R_init_MPCC(DllInfo* info) {
+    R_registerRoutines(info, NULL, CallEntries, NULL, NULL);
+    R_useDynamicSymbols(info, FALSE);
 }
 
+// Free the workspace cached by R_pcc when the shared library is unloaded
+extern "C" void R_unload_MPCC(DllInfo* info) {
+    R_pcc_workspace_free();
+}
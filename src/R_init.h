@@ -2,7 +2,8 @@
 #ifndef R_INIT_MPCC_H
   #define R_INIT_MPCC_H
   #include "MPCC.h"
-  void R_init_mpcc(DllInfo* info);
-
-#endif // R_INIT_CTL_H
+  #include <R_ext/Rdynload.h>
+  extern "C" void R_init_MPCC(DllInfo* info);
+  extern "C" void R_unload_MPCC(DllInfo* info);
 
+#endif // R_INIT_MPCC_H
@@ -2,19 +2,298 @@
 
 extern "C" {
 
-  // Wrap the matrix version into a C call
-  void R_pcc_matrix(double* aM, double* bM, int* nptr, int* mptr, int* pptr, double* res) {
-    #ifndef NOMKL
-    pcc_matrix((int)(*mptr), (int)(*nptr), (int)(*pptr), aM, bM, res);
+  // Use an R matrix as double without copying, other types (integer, logical) are coerced
+  static SEXP R_as_double(SEXP x) {
+    if (TYPEOF(x) == REALSXP) return x;
+    return coerceVector(x, REALSXP);
+  }
+
+  // Column names of an R matrix, or R_NilValue
+  static SEXP R_colnames(SEXP x) {
+    SEXP dn = getAttrib(x, R_DimNamesSymbol);
+    if (isNull(dn)) return R_NilValue;
+    return VECTOR_ELT(dn, 1);
+  }
+
+  #ifndef NOBLAS
+  // Workspace of the matrix version, kept between calls so that loops over many PCC() calls do not
+  // allocate (and page fault) the intermediate buffers every time. It grows to the largest problem.
+  static pcc_workspace R_workspace = { NULL, 0 };
+  #endif
+
+  // Release the cached workspace, called when the package is unloaded
+  void R_pcc_workspace_free() {
+    #ifndef NOBLAS
+    pcc_workspace_free(&R_workspace);
+    #endif
+  }
+
+  // Wrap the matrix, vector and naive versions into a .Call
+  // aM (n x m) and bM (n x p) are passed to the algorithms in place (the column major R matrices are
+  // the row major A and B), when bM is NULL the symmetric auto correlation of aM is computed.
+  // The algorithms write a row major result, so computing cor(bM, aM) gives the m x p matrix in R's
+  // column major layout directly; the result is allocated once and returned with dim and dimnames
+  SEXP R_pcc(SEXP aM, SEXP bM, SEXP backend) {
+    int n = nrows(aM);
+    int m = ncols(aM);
+    bool sym = isNull(bM);
+    int p = sym ? m : ncols(bM);
+    if (!sym && nrows(bM) != n) err("Matrices aM and bM need the same number of rows: %d != %d", n, nrows(bM));
+    const char* method = CHAR(STRING_ELT(backend, 0));
+
+    SEXP dimnames = PROTECT(allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, R_colnames(aM));
+    SET_VECTOR_ELT(dimnames, 1, sym ? R_colnames(aM) : R_colnames(bM));
+
+    aM = PROTECT(R_as_double(aM));
+    bM = PROTECT(sym ? aM : R_as_double(bM));
+    SEXP res = PROTECT(allocMatrix(REALSXP, m, p));
+    const double* A = REAL(aM);
+    const double* B = REAL(bM);
+
+    #ifndef NOBLAS
+    if (strcmp(method, "matrix") == 0) {
+      if (sym) pcc_matrix_sym(m, n, A, REAL(res), &R_workspace);
+      else pcc_matrix(p, n, m, B, A, REAL(res), &R_workspace);
+    } else if (strcmp(method, "vector") == 0) {
+      pcc_vector(p, n, m, B, A, REAL(res));
+    } else {
+      pcc_naive(p, n, m, B, A, REAL(res));
+    }
+    #else
+    if (strcmp(method, "naive") != 0) info("[WARNING] Library compiled without BLAS support, using the naive algorithm: %d\n", 0);
+    pcc_naive(p, n, m, B, A, REAL(res));
+    #endif
+
+    if (!isNull(VECTOR_ELT(dimnames, 0)) || !isNull(VECTOR_ELT(dimnames, 1))) setAttrib(res, R_DimNamesSymbol, dimnames);
+    UNPROTECT(4);
+    return res;
+  }
+
+  // Wrap the batched matrix version into a .Call
+  // aL is a list of double matrices (n_k x m_k), bL NULL or a list of double matrices (n_k x p_k) of the same
+  // length, sL NULL or a list of (1 based) rows of aL[[k]] and bL[[k]] which select the observations of
+  // problem k. Every problem is set up like R_pcc, all of them are solved by one pcc_matrix_batch call.
+  // Returns the list of (m_k x p_k) result matrices, with dimnames.
+  SEXP R_pcc_batch(SEXP aL, SEXP bL, SEXP sL) {
+    #ifndef NOBLAS
+    int count = length(aL);
+    if (!isNull(bL) && length(bL) != count) err("Lists aM and bM need the same length: %d != %d", count, length(bL));
+    if (!isNull(sL) && length(sL) != count) err("Lists aM and subsets need the same length: %d != %d", count, length(sL));
+    pcc_problem* problems = (pcc_problem*)R_alloc(count > 0 ? count : 1, sizeof(pcc_problem));
+    SEXP res = PROTECT(allocVector(VECSXP, count));
+    for (int k = 0; k < count; k++) {
+      SEXP aM = VECTOR_ELT(aL, k);
+      SEXP bM = isNull(bL) ? R_NilValue : VECTOR_ELT(bL, k);
+      if (TYPEOF(aM) != REALSXP || (!isNull(bM) && TYPEOF(bM) != REALSXP)) err("Problem %d: matrices need to be double", k + 1);
+      int n = nrows(aM);
+      int m = ncols(aM);
+      bool sym = isNull(bM);
+      int p = sym ? m : ncols(bM);
+      if (!sym && nrows(bM) != n) err("Problem %d: matrices aM and bM need the same number of rows: %d != %d", k + 1, n, nrows(bM));
+
+      SEXP x = allocMatrix(REALSXP, m, p);
+      SET_VECTOR_ELT(res, k, x);
+      SEXP dimnames = PROTECT(allocVector(VECSXP, 2));
+      SET_VECTOR_ELT(dimnames, 0, R_colnames(aM));
+      SET_VECTOR_ELT(dimnames, 1, sym ? R_colnames(aM) : R_colnames(bM));
+      if (!isNull(VECTOR_ELT(dimnames, 0)) || !isNull(VECTOR_ELT(dimnames, 1))) setAttrib(x, R_DimNamesSymbol, dimnames);
+      UNPROTECT(1);
+
+      // cor(bM, aM) in row major order is the m x p result in column major order
+      pcc_problem* pr = &problems[k];
+      pr->n = n;
+      pr->m = sym ? m : p;
+      pr->p = m;
+      pr->A = sym ? REAL(aM) : REAL(bM);
+      pr->B = sym ? NULL : REAL(aM);
+      pr->P = REAL(x);
+      pr->obs = NULL;
+      pr->nobs = 0;
+      if (!isNull(sL)) {
+        SEXP s = VECTOR_ELT(sL, k);
+        int* obs = (int*)R_alloc(length(s) > 0 ? length(s) : 1, sizeof(int));
+        for (int e = 0; e < length(s); e++) {
+          obs[e] = INTEGER(s)[e] - 1;
+          if (obs[e] < 0 || obs[e] >= n) err("Problem %d: subset row %d out of range", k + 1, obs[e] + 1);
+        }
+        pr->obs = obs;
+        pr->nobs = length(s);
+      }
+    }
+    pcc_matrix_batch(count, problems);
+    UNPROTECT(1);
+    return res;
+    #else
+    err("Library compiled without BLAS support, the batched version requires the optimized version: %d\n", 0);
+    return R_NilValue;
+    #endif
+  }
+
+  // Wrap the group conditioned matrix version into a .Call
+  // gL is a list of (1 based) row indices of aM and bM, the observations of every group. Like R_pcc the
+  // result of a group is computed as cor(bM, aM) to get R's column major layout. Returns the list of
+  // (m x p) result matrices, with dimnames.
+  SEXP R_pcc_groups(SEXP aM, SEXP bM, SEXP gL) {
+    int n = nrows(aM);
+    int m = ncols(aM);
+    bool sym = isNull(bM);
+    int p = sym ? m : ncols(bM);
+    if (!sym && nrows(bM) != n) err("Matrices aM and bM need the same number of rows: %d != %d", n, nrows(bM));
+
+    #ifndef NOBLAS
+    int ngroups = length(gL);
+    // the groups together may list more than 2^31 observations, so the offsets are 64 bit
+    size_t* start = (size_t*)R_alloc(ngroups + 1, sizeof(size_t));
+    start[0] = 0;
+    for (int g = 0; g < ngroups; g++) start[g + 1] = start[g] + XLENGTH(VECTOR_ELT(gL, g));
+    int* obs = (int*)R_alloc(start[ngroups] > 0 ? start[ngroups] : 1, sizeof(int));
+    for (int g = 0; g < ngroups; g++) {
+      SEXP s = VECTOR_ELT(gL, g);
+      for (R_xlen_t e = 0; e < XLENGTH(s); e++) {
+        obs[start[g] + e] = INTEGER(s)[e] - 1;
+        if (obs[start[g] + e] < 0 || obs[start[g] + e] >= n) err("Group %d: row %d out of range", g + 1, INTEGER(s)[e]);
+      }
+    }
+
+    SEXP dimnames = PROTECT(allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, R_colnames(aM));
+    SET_VECTOR_ELT(dimnames, 1, sym ? R_colnames(aM) : R_colnames(bM));
+    bool named = !isNull(VECTOR_ELT(dimnames, 0)) || !isNull(VECTOR_ELT(dimnames, 1));
+
+    aM = PROTECT(R_as_double(aM));
+    bM = PROTECT(sym ? aM : R_as_double(bM));
+    SEXP res = PROTECT(allocVector(VECSXP, ngroups));
+    double** P = (double**)R_alloc(ngroups > 0 ? ngroups : 1, sizeof(double*));
+    for (int g = 0; g < ngroups; g++) {
+      SEXP x = allocMatrix(REALSXP, m, p);
+      SET_VECTOR_ELT(res, g, x);
+      if (named) setAttrib(x, R_DimNamesSymbol, dimnames);
+      P[g] = REAL(x);
+    }
+    if (sym) pcc_matrix_groups(m, n, m, REAL(aM), NULL, ngroups, start, obs, P);
+    else pcc_matrix_groups(p, n, m, REAL(bM), REAL(aM), ngroups, start, obs, P);
+    UNPROTECT(4);
+    return res;
+    #else
+    err("Library compiled without BLAS support, the group version requires the optimized version: %d\n", 0);
+    return R_NilValue;
+    #endif
+  }
+
+  // Wrap the Spearman rank correlation into a .Call, like R_pcc the result is computed as cor(bM, aM)
+  // to get R's column major layout. exact re-ranks the pairs with different missing values.
+  SEXP R_spearman(SEXP aM, SEXP bM, SEXP exact) {
+    int n = nrows(aM);
+    int m = ncols(aM);
+    bool sym = isNull(bM);
+    int p = sym ? m : ncols(bM);
+    if (!sym && nrows(bM) != n) err("Matrices aM and bM need the same number of rows: %d != %d", n, nrows(bM));
+
+    SEXP dimnames = PROTECT(allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, R_colnames(aM));
+    SET_VECTOR_ELT(dimnames, 1, sym ? R_colnames(aM) : R_colnames(bM));
+
+    aM = PROTECT(R_as_double(aM));
+    bM = PROTECT(sym ? aM : R_as_double(bM));
+    SEXP res = PROTECT(allocMatrix(REALSXP, m, p));
+    if (sym) pcc_spearman(m, n, m, REAL(aM), NULL, REAL(res), asLogical(exact) == TRUE);
+    else pcc_spearman(p, n, m, REAL(bM), REAL(aM), REAL(res), asLogical(exact) == TRUE);
+
+    if (!isNull(VECTOR_ELT(dimnames, 0)) || !isNull(VECTOR_ELT(dimnames, 1))) setAttrib(res, R_DimNamesSymbol, dimnames);
+    UNPROTECT(4);
+    return res;
+  }
+
+  // Wrap the sparse (threshold / top-k) matrix version into a .Call
+  // Returns a list with the (1 based) column indices i of aM and j of bM, the correlation r and the
+  // number of pairwise complete observations n of the pairs with |r| >= threshold (top k per column of aM)
+  // precision selects the SAB products (0 full, 1 bf16, 2 int8), pairs with |r| >= rescore are recomputed exactly
+  SEXP R_pcc_sparse(SEXP aM, SEXP bM, SEXP threshold, SEXP k, SEXP precision, SEXP rescore) {
+    int n = nrows(aM);
+    int m = ncols(aM);
+    bool sym = isNull(bM);
+    int p = sym ? m : ncols(bM);
+    if (!sym && nrows(bM) != n) err("Matrices aM and bM need the same number of rows: %d != %d", n, nrows(bM));
+
+    #ifndef NOBLAS
+    aM = PROTECT(R_as_double(aM));
+    bM = PROTECT(sym ? aM : R_as_double(bM));
+    pcc_sparse S;
+    pcc_matrix_sparse(m, n, p, REAL(aM), sym ? NULL : REAL(bM), asReal(threshold), asInteger(k), &S,
+                      asInteger(precision), asReal(rescore));
+
+    SEXP res = PROTECT(allocVector(VECSXP, 4));
+    SEXP names = PROTECT(allocVector(STRSXP, 4));
+    SEXP ri = allocVector(INTSXP, S.nnz);
+    SET_VECTOR_ELT(res, 0, ri);
+    SEXP rj = allocVector(INTSXP, S.nnz);
+    SET_VECTOR_ELT(res, 1, rj);
+    SEXP rr = allocVector(REALSXP, S.nnz);
+    SET_VECTOR_ELT(res, 2, rr);
+    SEXP rn = allocVector(INTSXP, S.nnz);
+    SET_VECTOR_ELT(res, 3, rn);
+    for (size_t e = 0; e < S.nnz; e++) {
+      INTEGER(ri)[e] = S.i[e] + 1;
+      INTEGER(rj)[e] = S.j[e] + 1;
+      REAL(rr)[e] = S.r[e];
+      INTEGER(rn)[e] = (int)S.n[e];
+    }
+    pcc_sparse_free(&S);
+    SET_STRING_ELT(names, 0, mkChar("i"));
+    SET_STRING_ELT(names, 1, mkChar("j"));
+    SET_STRING_ELT(names, 2, mkChar("r"));
+    SET_STRING_ELT(names, 3, mkChar("n"));
+    setAttrib(res, R_NamesSymbol, names);
+    UNPROTECT(4);
+    return res;
     #else
-    info("[WARNING] Library compiled with NO Intel MKL support: %d\n", 0);
-    pcc_naive((int)(*mptr), (int)(*nptr), (int)(*pptr), aM, bM, res);
+    err("Library compiled without BLAS support, the sparse output requires the optimized version: %d\n", 0);
+    return R_NilValue;
     #endif
   }
 
-  // Wrap the naive version into a C call
-  void R_pcc_naive(double* aM, double* bM, int* nptr, int* mptr, int* pptr, double* res) {
-    pcc_naive((int)(*mptr), (int)(*nptr), (int)(*pptr), aM, bM, res);
+  // Wrap the matrix version with significance into a .Call
+  // Returns a list with the m x p matrices of correlations r, t statistics t, two sided p-values p and
+  // pairwise complete observations n, computed like R_pcc as cor(bM, aM) to get R's column major layout
+  SEXP R_pcc_stats(SEXP aM, SEXP bM) {
+    int n = nrows(aM);
+    int m = ncols(aM);
+    bool sym = isNull(bM);
+    int p = sym ? m : ncols(bM);
+    if (!sym && nrows(bM) != n) err("Matrices aM and bM need the same number of rows: %d != %d", n, nrows(bM));
+
+    #ifndef NOBLAS
+    SEXP dimnames = PROTECT(allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, R_colnames(aM));
+    SET_VECTOR_ELT(dimnames, 1, sym ? R_colnames(aM) : R_colnames(bM));
+    bool named = !isNull(VECTOR_ELT(dimnames, 0)) || !isNull(VECTOR_ELT(dimnames, 1));
+
+    aM = PROTECT(R_as_double(aM));
+    bM = PROTECT(sym ? aM : R_as_double(bM));
+    SEXP res = PROTECT(allocVector(VECSXP, 4));
+    SEXP names = PROTECT(allocVector(STRSXP, 4));
+    const char* fields[4] = {"r", "t", "p", "n"};
+    for (int k = 0; k < 4; k++) {
+      SEXP x = allocMatrix(REALSXP, m, p);
+      SET_VECTOR_ELT(res, k, x);
+      if (named) setAttrib(x, R_DimNamesSymbol, dimnames);
+      SET_STRING_ELT(names, k, mkChar(fields[k]));
+    }
+    if (sym) {
+      pcc_matrix_stats(m, n, m, REAL(aM), NULL, REAL(VECTOR_ELT(res, 0)), REAL(VECTOR_ELT(res, 3)),
+                       REAL(VECTOR_ELT(res, 1)), REAL(VECTOR_ELT(res, 2)));
+    } else {
+      pcc_matrix_stats(p, n, m, REAL(bM), REAL(aM), REAL(VECTOR_ELT(res, 0)), REAL(VECTOR_ELT(res, 3)),
+                       REAL(VECTOR_ELT(res, 1)), REAL(VECTOR_ELT(res, 2)));
+    }
+    setAttrib(res, R_NamesSymbol, names);
+    UNPROTECT(5);
+    return res;
+    #else
+    err("Library compiled without BLAS support, the significance output requires the optimized version: %d\n", 0);
+    return R_NilValue;
+    #endif
   }
 }
 
@@ -7,13 +7,20 @@
   #define __INTERFACE_H__
 
   #include "MPCC.h"
+  #include <Rinternals.h>
+  #include <string.h>
 
   /** Function to 'update' R, checks user input and can flushes console. */
   void    updateR(bool flush);
-  /** R interface to perform a CTL scan and permutations on phenotype 'phenotype' */
+  /** R interfaces to compute the (dense or sparse) PCC matrix, its significance, or the Spearman correlation between the columns of aM and bM, a batch of PCC problems, or per group of observations */
   extern "C" {
-    void R_pcc_matrix(double* aM, double* bM, int* nptr, int* mptr, int* pptr, double* res);
-    void R_pcc_naive(double* aM, double* bM, int* nptr, int* mptr, int* pptr, double* res); 
+    SEXP R_pcc(SEXP aM, SEXP bM, SEXP backend);
+    SEXP R_pcc_sparse(SEXP aM, SEXP bM, SEXP threshold, SEXP k, SEXP precision, SEXP rescore);
+    SEXP R_pcc_stats(SEXP aM, SEXP bM);
+    SEXP R_spearman(SEXP aM, SEXP bM, SEXP exact);
+    SEXP R_pcc_batch(SEXP aL, SEXP bL, SEXP sL);
+    SEXP R_pcc_groups(SEXP aM, SEXP bM, SEXP gL);
+    void R_pcc_workspace_free();
   }
 
 #endif //__INTERFACE_H__
@@ -0,0 +1,83 @@
+// copyright (c) - HU-Berlin / UTHSC / JICS by Danny Arends
+
+// Accuracy of the float build (the R package always computes in double): pcc_matrix and pcc_vector
+// versus a two pass double precision reference, on variables with a large mean and a small spread
+// (see README, Numerical accuracy). The vector version accumulates its terms in the data type and
+// gets a looser bound. Built and run by: make MKL=0 check
+#include "MPCC.h"
+#include <vector>
+#include <random>
+
+static const double PCC_FLOAT_TOLERANCE[2] = { 5e-7, 1e-6 }; //pcc_matrix, pcc_vector
+
+//Rows share a random factor with a per row weight, so the correlations spread over [-1, 1]
+static void fill(std::vector<DataType>& X, int rows, int n, double mean, double sd, double missing,
+                 const std::vector<double>& factor, std::mt19937& rng)
+{
+  std::normal_distribution<double> normal(0.0, 1.0);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  for (int i=0; i<rows; i++) {
+    double w = 2.0 * unif(rng) - 1.0;
+    for (int k=0; k<n; k++) {
+      X[(size_t)i*n + k] = (unif(rng) < missing) ? NAN : (DataType)(mean + sd * (w * factor[k] + normal(rng)));
+    }
+  }
+}
+
+//Two pass PCC in double over the pairwise complete observations of a and b
+static double reference(const DataType* a, const DataType* b, int n)
+{
+  double sa = 0.0, sb = 0.0, nn = 0.0;
+  for (int k=0; k<n; k++) {
+    if (CHECKNA(a[k]) || CHECKNA(b[k])) continue;
+    sa += a[k]; sb += b[k]; nn++;
+  }
+  double ma = sa / nn, mb = sb / nn, sab = 0.0, saa = 0.0, sbb = 0.0;
+  for (int k=0; k<n; k++) {
+    if (CHECKNA(a[k]) || CHECKNA(b[k])) continue;
+    sab += (a[k] - ma) * (b[k] - mb); saa += (a[k] - ma) * (a[k] - ma); sbb += (b[k] - mb) * (b[k] - mb);
+  }
+  return sab / sqrt(saa * sbb);
+}
+
+static int check(const char* name, double mean, double sd, double missing)
+{
+  int m = 120, n = 400, p = 90;
+  std::mt19937 rng(1);
+  std::normal_distribution<double> normal(0.0, 1.0);
+  std::vector<double> factor(n);
+  for (int k=0; k<n; k++) factor[k] = normal(rng);
+  std::vector<DataType> A((size_t)m*n), B((size_t)p*n), P((size_t)m*p);
+  fill(A, m, n, mean, sd, missing, factor, rng);
+  fill(B, p, n, mean, sd, missing, factor, rng);
+
+  int failed = 0;
+  for (int version=0; version<2; version++) {
+    if (version == 0) pcc_matrix(m, n, p, A.data(), B.data(), P.data());
+    else pcc_vector(m, n, p, A.data(), B.data(), P.data());
+    double diff = 0.0;
+    for (int i=0; i<m; i++) for (int j=0; j<p; j++) {
+      double d = fabs((double)P[(size_t)i*p + j] - reference(&A[(size_t)i*n], &B[(size_t)j*n], n));
+      if (!(d <= diff)) diff = d;
+    }
+    bool ok = diff <= PCC_FLOAT_TOLERANCE[version];
+    printf("%s %s, missing %g: max difference %e (tolerance %g) %s\n", version == 0 ? "pcc_matrix" : "pcc_vector",
+           name, missing, diff, PCC_FLOAT_TOLERANCE[version], ok ? "ok" : "FAILED");
+    if (!ok) failed++;
+  }
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  int failed = 0;
+  failed += check("mean 10 sd 0.2", 10.0, 0.2, 0.0);
+  failed += check("mean 10 sd 0.2", 10.0, 0.2, 0.1);
+  failed += check("mean 1000 sd 0.5", 1000.0, 0.5, 0.0);
+  failed += check("mean 1000 sd 0.5", 1000.0, 0.5, 0.1);
+  if (failed > 0) {
+    printf("%d of 8 float accuracy checks FAILED\n", failed);
+    return 1;
+  }
+  return 0;
+}